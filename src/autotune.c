@@ -0,0 +1,78 @@
+#include <math.h>
+#include "esp_attr.h"
+
+#include "autotune.h"
+#include "dc_motor_hal.h"
+
+// position error band around zero without switching, against encoder noise
+#define AUTOTUNE_HYSTERESIS PID_VALUE(0.5)
+
+static void IRAM_ATTR autotune_set_state(autotune_t *autotune, autotune_state_t state)
+{
+    __atomic_store_n(&autotune->state, state, __ATOMIC_RELEASE);
+}
+
+void IRAM_ATTR autotune_begin(autotune_t *autotune, pid_gain_t output, pid_gain_t amplitude)
+{
+    if ((amplitude == 0) || (amplitude > output)) amplitude = output / 2;
+    // the high state stays within full duty
+    pid_gain_t headroom = PID_GAIN(1.0) - output;
+    if (amplitude > headroom) amplitude = headroom;
+
+    autotune->bias = output;
+    autotune->amplitude = amplitude;
+    autotune->high = true;
+    autotune->period = 0;
+    autotune->last_switch = 0;
+    autotune->switches = 0;
+    autotune->error_max = 0;
+    autotune->error_min = 0;
+    autotune->swing_sum = 0;
+    autotune->period_sum = 0;
+    autotune->cycles = 0;
+    autotune_set_state(autotune, (amplitude > 0) ? AUTOTUNE_RUNNING : AUTOTUNE_FAILED);
+}
+
+void IRAM_ATTR autotune_abort(autotune_t *autotune)
+{
+    if (autotune->state == AUTOTUNE_RUNNING) autotune_set_state(autotune, AUTOTUNE_FAILED);
+}
+
+pid_gain_t IRAM_ATTR autotune_step(autotune_t *autotune, pid_value_t error)
+{
+    autotune->period++;
+    if (error > autotune->error_max) autotune->error_max = error;
+    if (error < autotune->error_min) autotune->error_min = error;
+
+    // behind the target (positive error) drives harder
+    if (!autotune->high && (error > AUTOTUNE_HYSTERESIS)) {
+        autotune->high = true;
+        // one full cycle between two switches to high
+        if (++autotune->switches > AUTOTUNE_SKIP_CYCLES) {
+            autotune->swing_sum += PID_VALUE_TO_Q16(autotune->error_max - autotune->error_min);
+            autotune->period_sum += autotune->period - autotune->last_switch;
+            if (++autotune->cycles == AUTOTUNE_CYCLES) autotune_set_state(autotune, AUTOTUNE_DONE);
+        }
+        autotune->last_switch = autotune->period;
+        autotune->error_max = error;
+        autotune->error_min = error;
+    }
+    else if (autotune->high && (error < -AUTOTUNE_HYSTERESIS)) {
+        autotune->high = false;
+    }
+    else if (autotune->period - autotune->last_switch > AUTOTUNE_TIMEOUT_S * CONTROL_RATE_HZ) {
+        autotune_set_state(autotune, AUTOTUNE_FAILED);
+    }
+
+    return autotune->high ? autotune->bias + autotune->amplitude : autotune->bias - autotune->amplitude;
+}
+
+void autotune_result(const autotune_t *autotune, double *ku, double *tu)
+{
+    double amplitude = PID_GAIN_TO_DOUBLE(autotune->amplitude);
+    double swing = (double)autotune->swing_sum / autotune->cycles / 65536;
+
+    // describing function of an ideal relay, the error swings +-swing/2
+    *ku = 4 * amplitude / (M_PI * swing / 2);
+    *tu = (double)autotune->period_sum / autotune->cycles / CONTROL_RATE_HZ;
+}
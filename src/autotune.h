@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pid.h"
+
+// relay feedback experiment: while tracking, the output switches between
+// bias +- amplitude on the sign of the position error, the resulting limit
+// cycle gives the ultimate gain and period of the loop
+#define AUTOTUNE_SKIP_CYCLES 2
+#define AUTOTUNE_CYCLES 6
+#define AUTOTUNE_TIMEOUT_S 20     // without a relay switch
+
+typedef enum {
+    AUTOTUNE_IDLE,
+    AUTOTUNE_STARTING,            // posted, not taken by the ISR yet
+    AUTOTUNE_RUNNING,
+    AUTOTUNE_DONE,
+    AUTOTUNE_FAILED,
+} autotune_state_t;
+
+typedef struct {
+    autotune_state_t state;
+
+    // owned by the control ISR while running
+    pid_gain_t bias;
+    pid_gain_t amplitude;
+    bool high;
+    int32_t period;               // control periods since the start
+    int32_t last_switch;
+    int32_t switches;
+    pid_value_t error_max;
+    pid_value_t error_min;
+
+    // result, valid in AUTOTUNE_DONE
+    int64_t swing_sum;            // peak to peak position error, Q16 counts
+    int32_t period_sum;           // control periods
+    int32_t cycles;
+} autotune_t;
+
+// control ISR, amplitude 0 uses half the current output; limited to the
+// output and to the duty left above it, fails if that leaves none
+void autotune_begin(autotune_t *autotune, pid_gain_t output, pid_gain_t amplitude);
+void autotune_abort(autotune_t *autotune);
+// relay output for this period; on the last cycle the state changes to done
+pid_gain_t autotune_step(autotune_t *autotune, pid_value_t error);
+
+// ultimate gain (duty per count) and period (s) of the finished experiment
+void autotune_result(const autotune_t *autotune, double *ku, double *tu);
@@ -0,0 +1,293 @@
+#include "axis.h"
+
+void axis_init(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_init(axis->dc_motor);
+            break;
+        case AXIS_STEPPER:
+            stepper_init(axis->stepper);
+            break;
+        case AXIS_STUB:
+            *axis->stub = (axis_stub_t){ .rate_interval_us = 1000000 };
+            guide_init(&axis->stub->guide);
+            break;
+    }
+    // the SynScan default
+    axis_set_guide_rate(axis, 0.5);
+}
+
+void axis_start(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_start(axis->dc_motor);
+            break;
+        case AXIS_STEPPER:
+            stepper_start(axis->stepper);
+            break;
+        case AXIS_STUB:
+            if (axis->stub->stop_at_target) axis->stub->position = axis->stub->target;
+            axis->stub->running = !axis->stub->stop_at_target;
+            break;
+    }
+}
+
+void axis_stop(axis_t *axis, bool instant)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            // coasts either way
+            dc_motor_stop(axis->dc_motor);
+            break;
+        case AXIS_STEPPER:
+            stepper_stop(axis->stepper, instant);
+            break;
+        case AXIS_STUB:
+            axis->stub->running = false;
+            break;
+    }
+}
+
+void axis_suspend(axis_t *axis, bool suspend)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_suspend(axis->dc_motor, suspend);
+            break;
+        case AXIS_STEPPER:
+            stepper_suspend(axis->stepper, suspend);
+            break;
+        case AXIS_STUB:
+            break;
+    }
+}
+
+void axis_set_direction(axis_t *axis, bool direction)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_direction(axis->dc_motor, direction);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_direction(axis->stepper, direction);
+            break;
+        case AXIS_STUB:
+            axis->stub->direction = direction;
+            break;
+    }
+}
+
+void axis_set_stop_at_target(axis_t *axis, bool stop)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_stop_at_target(axis->dc_motor, stop);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_stop_at_target(axis->stepper, stop);
+            break;
+        case AXIS_STUB:
+            axis->stub->stop_at_target = stop;
+            break;
+    }
+}
+
+void axis_set_init(axis_t *axis, bool init)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_init(axis->dc_motor, init);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_init(axis->stepper, init);
+            break;
+        case AXIS_STUB:
+            axis->stub->init = init;
+            break;
+    }
+}
+
+void axis_set_position(axis_t *axis, int32_t position)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_position(axis->dc_motor, position);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_position(axis->stepper, position);
+            break;
+        case AXIS_STUB:
+            axis->stub->position = position;
+            break;
+    }
+}
+
+void axis_set_target(axis_t *axis, int32_t target)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_target(axis->dc_motor, target);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_target(axis->stepper, target);
+            break;
+        case AXIS_STUB:
+            axis->stub->target = target;
+            break;
+    }
+}
+
+void axis_set_rate(axis_t *axis, uint32_t counts, uint32_t interval_us)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_rate(axis->dc_motor, counts, interval_us);
+            break;
+        case AXIS_STEPPER:
+            stepper_set_rate(axis->stepper, counts, interval_us);
+            break;
+        case AXIS_STUB:
+            axis->stub->rate_counts = counts;
+            axis->stub->rate_interval_us = interval_us;
+            break;
+    }
+}
+
+void axis_set_worm_phase(axis_t *axis, int32_t worm_phase)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_set_worm_phase(axis->dc_motor, worm_phase);
+            break;
+        case AXIS_STEPPER:
+        case AXIS_STUB:
+            break;
+    }
+}
+
+bool axis_get_direction(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_direction(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_direction(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->direction;
+    }
+    return 0;
+}
+
+bool axis_get_running(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_running(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_running(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->running;
+    }
+    return 0;
+}
+
+bool axis_get_stop_at_target(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_stop_at_target(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_stop_at_target(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->stop_at_target;
+    }
+    return 0;
+}
+
+bool axis_get_init(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_init(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_init(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->init;
+    }
+    return 0;
+}
+
+int32_t axis_get_position(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_position(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_position(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->position;
+    }
+    return 0;
+}
+
+void axis_get_rate(axis_t *axis, uint32_t *counts, uint32_t *interval_us)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            dc_motor_get_rate(axis->dc_motor, counts, interval_us);
+            break;
+        case AXIS_STEPPER:
+            stepper_get_rate(axis->stepper, counts, interval_us);
+            break;
+        case AXIS_STUB:
+            *counts = axis->stub->rate_counts;
+            *interval_us = axis->stub->rate_interval_us;
+            break;
+    }
+}
+
+int32_t axis_get_target(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_target(axis->dc_motor);
+        case AXIS_STEPPER:
+            return stepper_get_target(axis->stepper);
+        case AXIS_STUB:
+            return axis->stub->target;
+    }
+    return 0;
+}
+
+int32_t axis_get_worm_phase(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return dc_motor_get_worm_phase(axis->dc_motor);
+        case AXIS_STEPPER:
+        case AXIS_STUB:
+            break;
+    }
+    return 0;
+}
+
+guide_t *axis_get_guide(axis_t *axis)
+{
+    switch (axis->type) {
+        case AXIS_DC_MOTOR:
+            return &axis->dc_motor->guide;
+        case AXIS_STEPPER:
+            return &axis->stepper->guide;
+        case AXIS_STUB:
+            return &axis->stub->guide;
+    }
+    return NULL;
+}
+
+void axis_set_guide_rate(axis_t *axis, double rate)
+{
+    double sidereal = (double)axis->worm_period * WORM_TEETH / SIDEREAL_DAY_S / CONTROL_RATE_HZ;
+    guide_set_rate(axis_get_guide(axis), PID_VALUE_TO_Q16(PID_VALUE(rate * sidereal)));
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "motor.h"
+#include "stepper.h"
+
+// one entry per mount axis, the EQMOD handlers go through these
+typedef enum {
+    AXIS_DC_MOTOR,
+    AXIS_STEPPER,
+    AXIS_STUB,
+} axis_type_t;
+
+// no hardware behind it, for deterministic replays: a goto arrives at its
+// target when started, tracking keeps the position, see replay.h
+typedef struct {
+    int32_t position;
+    int32_t target;
+    uint32_t rate_counts;
+    uint32_t rate_interval_us;
+    bool direction;
+    bool stop_at_target;
+    bool init;
+    bool running;
+    guide_t guide;
+} axis_stub_t;
+
+typedef struct {
+    axis_type_t type;
+    union {
+        dc_motor_context_t *dc_motor;
+        stepper_context_t *stepper;
+        axis_stub_t *stub;
+    };
+    int32_t steps_mul;        // backend counts per EQMOD step
+    int32_t worm_period;      // backend counts per worm revolution
+    int32_t high_speed;       // rate multiplier of the :G fast modes, :g
+
+    // owned by the command handlers
+    bool fast;                // :I periods are high_speed times shorter
+} axis_t;
+
+#define AXES 2                // right ascension, declination
+
+#define SIDEREAL_DAY_S 86164.0905
+#define WORM_TEETH 144
+
+extern axis_t axes[AXES];
+
+// also back to its initial state for a stub
+void axis_init(axis_t *axis);
+
+void axis_start(axis_t *axis);
+void axis_stop(axis_t *axis, bool instant);
+
+// with the scheduler suspended and the axis stopped, see power.h
+void axis_suspend(axis_t *axis, bool suspend);
+
+void axis_set_direction(axis_t *axis, bool direction);
+void axis_set_stop_at_target(axis_t *axis, bool stop);
+void axis_set_init(axis_t *axis, bool init);
+void axis_set_position(axis_t *axis, int32_t position);
+void axis_set_target(axis_t *axis, int32_t target);
+// tracking rate, counts every interval_us
+void axis_set_rate(axis_t *axis, uint32_t counts, uint32_t interval_us);
+// PEC phase, before scheduler_start; 0 on axes without PEC
+void axis_set_worm_phase(axis_t *axis, int32_t worm_phase);
+
+bool axis_get_direction(axis_t *axis);
+bool axis_get_running(axis_t *axis);
+bool axis_get_stop_at_target(axis_t *axis);
+bool axis_get_init(axis_t *axis);
+int32_t axis_get_position(axis_t *axis);
+void axis_get_rate(axis_t *axis, uint32_t *counts, uint32_t *interval_us);
+int32_t axis_get_target(axis_t *axis);
+int32_t axis_get_worm_phase(axis_t *axis);
+
+guide_t *axis_get_guide(axis_t *axis);
+// guide offset as a fraction of the sidereal rate
+void axis_set_guide_rate(axis_t *axis, double rate);
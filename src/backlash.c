@@ -0,0 +1,78 @@
+#include "nvs.h"
+
+#include "backlash.h"
+
+#define BACKLASH_NVS_NAMESPACE "backlash"
+#define BACKLASH_NVS_KEY "counts"
+
+void backlash_init(backlash_t *backlash)
+{
+    backlash->counts = 0;
+    backlash->engaged = false;
+    backlash->state = BACKLASH_IDLE;
+
+    uint32_t counts;
+    nvs_handle_t handle;
+    if (nvs_open(BACKLASH_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return;
+    esp_err_t err = nvs_get_u32(handle, BACKLASH_NVS_KEY, &counts);
+    nvs_close(handle);
+    if ((err == ESP_OK) && (counts <= BACKLASH_MAX)) backlash->counts = counts;
+}
+
+void backlash_set(backlash_t *backlash, uint32_t counts)
+{
+    backlash->counts = counts;
+
+    nvs_handle_t handle;
+    if (nvs_open(BACKLASH_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_set_u32(handle, BACKLASH_NVS_KEY, counts);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+uint32_t backlash_takeup(backlash_t *backlash, bool direction)
+{
+    // nothing known after a restart, the first run takes it up at its own speed
+    bool reversal = backlash->engaged && (direction != backlash->direction);
+    backlash->engaged = true;
+    backlash->direction = direction;
+    return reversal ? backlash->counts : 0;
+}
+
+int32_t backlash_estimate(const int32_t *travel, const pid_gain_t *output, int count)
+{
+    // fit the outputs as two levels, free before the split and engaged from
+    // it on; the split leaving the least squared error is where it engaged
+    double total = 0;
+    double total2 = 0;
+    for (int i = 0; i < count; i++) {
+        double o = PID_GAIN_TO_DOUBLE(output[i]);
+        total += o;
+        total2 += o * o;
+    }
+
+    int best = -1;
+    double best_cost = 0;
+    double free_mean = 0;
+    double engaged_mean = 0;
+    double sum = 0;
+    double sum2 = 0;
+    for (int k = 1; (k < count) && (travel[k] <= BACKLASH_MAX); k++) {
+        double o = PID_GAIN_TO_DOUBLE(output[k - 1]);
+        sum += o;
+        sum2 += o * o;
+        double left = sum / k;
+        double right = (total - sum) / (count - k);
+        double cost = (sum2 - sum * left) + ((total2 - sum2) - (total - sum) * right);
+        if ((best < 0) || (cost < best_cost)) {
+            best = k;
+            best_cost = cost;
+            free_mean = left;
+            engaged_mean = right;
+        }
+    }
+    if (best < 0) return -1;
+    // no free play that can be told from the load variation
+    if (engaged_mean - free_mean < engaged_mean / 4) return -1;
+    return travel[best];
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pid.h"
+
+// gear backlash between the motor encoder and the worm: after a reversal the
+// motor turns this many counts before it drives the worm again. A run in the
+// other direction than the last one starts with a fast takeup move of that
+// distance, which does not count as position.
+#define BACKLASH_MAX 1000         // counts
+
+// measured by reversing at BACKLASH_SPEED for BACKLASH_MAX + BACKLASH_ENGAGED
+// counts: the PID output drops while the motor turns free and rises again
+// once the gear engages
+#define BACKLASH_SPEED 200.0      // counts per second
+#define BACKLASH_ENGAGED 400      // counts, surely engaged at the end
+#define BACKLASH_SAMPLE_MS 10
+#define BACKLASH_SAMPLES 1024
+
+typedef enum {
+    BACKLASH_IDLE,
+    BACKLASH_MEASURING,
+    BACKLASH_DONE,
+    BACKLASH_FAILED,
+} backlash_state_t;
+
+// owned by the command handlers
+typedef struct {
+    uint32_t counts;
+    bool engaged;             // the last run direction is known
+    bool direction;           // of the last run
+    backlash_state_t state;
+} backlash_t;
+
+// loads the stored value from NVS
+void backlash_init(backlash_t *backlash);
+// also stores it in NVS
+void backlash_set(backlash_t *backlash, uint32_t counts);
+
+// counts to take up before a run in direction
+uint32_t backlash_takeup(backlash_t *backlash, bool direction);
+
+// the engaged point from samples of a reversal, travel in counts from its
+// start and the PID output in the run direction; -1 if none stands out
+int32_t backlash_estimate(const int32_t *travel, const pid_gain_t *output, int count);
@@ -0,0 +1,488 @@
+#include "sdkconfig.h"
+#include "bench.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+void bench_init(void)
+{
+}
+
+void bench_run(void)
+{
+}
+
+#else
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "axis.h"
+#include "scheduler.h"
+#include "timing.h"
+#include "power.h"
+#include "motion_profile.h"
+#include "sw_protocol.h"
+
+#define BENCH_SETTLE_S 30         // from the start until the error is measured
+
+// closed loop for the PID check: a first order motor, full duty turns it at
+// MAX_SPEED, with a random load
+#define BENCH_PID_UPDATES 1000000
+#define BENCH_PID_MAX_SPEED 8000.0  // counts per second
+#define BENCH_PID_TIME_CONSTANT 0.030
+#define BENCH_PID_LOAD 0.02         // duty, peak
+#define BENCH_PID_TOLERANCE 1e-4    // duty the fixed point output may differ by
+
+#define BENCH_FUZZ_COMMANDS 200000
+#define BENCH_PARSER_COMMANDS 1000000
+#define BENCH_ENCODER_EDGES 100000
+
+// the PCNT channel actions of dc_motor_hal_esp32.c, the count change of an
+// edge on the edge input, times the level factor of the other input
+typedef struct {
+    int rising, falling;      // edge action, +1 increase, -1 decrease
+    int high, low;            // level action, 1 keep, -1 inverse
+} bench_pcnt_channel_t;
+
+static const bench_pcnt_channel_t bench_pcnt_enc1 = { -1, 1, 1, -1 };   // channel A, ENC2 level
+static const bench_pcnt_channel_t bench_pcnt_enc2 = { 1, -1, 1, -1 };   // channel B, ENC1 level
+
+typedef struct {
+    dc_motor_context_t *motor;
+    int64_t start;            // us, sampling from then on, 0 until armed
+    int64_t first;            // us, time of the first sample
+    double worm_start;
+    double speed;             // commanded, counts per us
+    int64_t samples;
+    double sum;
+    double sum2;
+    double peak;
+} bench_tracking_t;
+
+static const char *bench;
+static bench_tracking_t tracking;
+
+// a control step after the motors, the simulated worm against the commanded rate
+static bool bench_tracking_step(void *user_ctx)
+{
+    bench_tracking_t *b = (bench_tracking_t *)user_ctx;
+    int64_t start = __atomic_load_n(&b->start, __ATOMIC_ACQUIRE);
+    int64_t now = scheduler_get_time();
+    if (!start || (now < start)) return false;
+
+    double worm = dc_motor_hal_sim_get_worm(&b->motor->hal);
+    if (!b->samples) {
+        b->first = now;
+        b->worm_start = worm;
+    }
+    double error = worm - b->worm_start - b->speed * (now - b->first);
+    b->samples++;
+    b->sum += error;
+    b->sum2 += error * error;
+    if (fabs(error) > b->peak) b->peak = fabs(error);
+    return false;
+}
+
+// upper bound of the histogram bucket holding the given share of the samples
+static uint32_t bench_percentile(const timing_hist_t *hist, double share)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < TIMING_BUCKETS; i++) total += hist->count[i];
+    uint64_t seen = 0;
+    for (int i = 0; i < TIMING_BUCKETS - 1; i++) {
+        seen += hist->count[i];
+        if (seen >= share * total) return 2u << i;
+    }
+    return hist->max;
+}
+
+static int bench_tracking(void)
+{
+    const char *env = getenv("SA_BENCH_HOURS");
+    double hours = env ? atof(env) : 1;
+    axis_t *a = &axes[0];
+
+    // sidereal, counts per 1000 s
+    uint32_t counts = llround(a->worm_period * WORM_TEETH * 1000.0 / SIDEREAL_DAY_S);
+    uint32_t interval_us = 1000000000;
+    tracking.speed = (double)counts / interval_us;
+
+    power_command_begin(true);
+    axis_set_direction(a, false);
+    axis_set_stop_at_target(a, false);
+    axis_set_rate(a, counts, interval_us);
+    axis_start(a);
+    power_command_end();
+
+    int64_t start = scheduler_get_time() + BENCH_SETTLE_S * 1000000LL;
+    int64_t end = start + (int64_t)(hours * 3600e6);
+    while (scheduler_get_time() < start) vTaskDelay(pdMS_TO_TICKS(10));
+    timing_reset();
+    __atomic_store_n(&tracking.start, start, __ATOMIC_RELEASE);
+    while (scheduler_get_time() < end) vTaskDelay(pdMS_TO_TICKS(100));
+    __atomic_store_n(&tracking.start, 0, __ATOMIC_RELEASE);
+
+    timing_hist_t hist;
+    timing_get(TIMING_ISR_DURATION, &hist);
+    double arcsec = 1296000.0 / ((double)a->worm_period * WORM_TEETH);
+    double mean = tracking.samples ? tracking.sum / tracking.samples : 0;
+    double rms = tracking.samples ? sqrt(tracking.sum2 / tracking.samples) : 0;
+    fprintf(stderr, "tracking %.2f h at %.3f counts/s, worm error in counts (arcsec):\n", hours, tracking.speed * 1e6);
+    fprintf(stderr, "  mean %.3f (%.3f) rms %.3f (%.3f) peak %.3f (%.3f)\n",
+            mean, mean * arcsec, rms, rms * arcsec, tracking.peak, tracking.peak * arcsec);
+    fprintf(stderr, "control step, %u cycles per us: p50 < %u, p99 < %u, max %u cycles\n",
+            timing_cycles_per_us(), bench_percentile(&hist, 0.5), bench_percentile(&hist, 0.99), hist.max);
+
+    env = getenv("SA_BENCH_LIMIT");
+    return (env && (tracking.peak * arcsec > atof(env))) ? 1 : 0;
+}
+
+// uniform in -1..1, repeatable
+static double bench_random(uint32_t *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return (int32_t)*state / 2147483648.0;
+}
+
+// 0..n-1 from the high bits, the low ones of the generator repeat quickly
+static uint32_t bench_pick(uint32_t *state, uint32_t n)
+{
+    *state = *state * 1664525 + 1013904223;
+    return (uint32_t)(((uint64_t)*state * n) >> 32);
+}
+
+static int bench_pid(void)
+{
+    dc_motor_context_t *motor = axes[0].dc_motor;
+    static int32_t errors[BENCH_PID_UPDATES];
+    const double dt = 1.0 / CONTROL_RATE_HZ;
+    bool failed = false;
+
+    fprintf(stderr, "regime  max difference  ns per update fixed / double\n");
+    for (int r = 0; r < DC_MOTOR_REGIMES; r++) {
+        double kp = PID_GAIN_TO_DOUBLE(motor->gains[r].Kp);
+        double ki = PID_GAIN_TO_DOUBLE(motor->gains[r].Ki);
+        double kd = PID_GAIN_TO_DOUBLE(motor->gains[r].Kd);
+        int32_t fkp = llround(kp * (1 << PID_GAIN_SHIFT));
+        int32_t fki = llround(ki * (1 << PID_GAIN_SHIFT));
+        int32_t fkd = llround(kd * (1 << PID_GAIN_SHIFT));
+        double target = ((r == DC_MOTOR_REGIME_SLEW) ? motor->slew_speed : DC_MOTOR_BASE_SPEED) * dt;
+
+        // the double PID drives the motor, the fixed point one sees the same
+        // Q16 errors and its output must stay with it
+        uint32_t seed = 1;
+        double output = 0;
+        double speed = 0;
+        double error = 0;
+        int32_t fixed = 0;
+        double worst = 0;
+        for (int i = 0; i < BENCH_PID_UPDATES; i++) {
+            error += target - speed * dt;
+            errors[i] = llround(error * (1 << PID_VALUE_SHIFT));
+            int32_t e1 = (i > 0) ? errors[i - 1] : 0;
+            int32_t e2 = (i > 1) ? errors[i - 2] : 0;
+            output = pid_update_double(output, errors[i] / 65536.0, e1 / 65536.0, e2 / 65536.0, kp, ki, kd);
+            fixed = pid_update_fixed(fixed, errors[i], e1, e2, fkp, fki, fkd);
+            double difference = fabs(output - (double)fixed / (1 << PID_GAIN_SHIFT));
+            if (difference > worst) worst = difference;
+
+            double drive = output - BENCH_PID_LOAD * (1 + bench_random(&seed)) / 2;
+            speed += (BENCH_PID_MAX_SPEED * drive - speed) * dt / BENCH_PID_TIME_CONSTANT;
+        }
+
+        // the same errors again, timed
+        volatile int32_t fixed_sink;
+        volatile double double_sink;
+        uint32_t start = timing_cycles();
+        fixed = 0;
+        for (int i = 2; i < BENCH_PID_UPDATES; i++) {
+            fixed = pid_update_fixed(fixed, errors[i], errors[i - 1], errors[i - 2], fkp, fki, fkd);
+        }
+        fixed_sink = fixed;
+        uint32_t fixed_ns = timing_cycles() - start;
+        start = timing_cycles();
+        output = 0;
+        for (int i = 2; i < BENCH_PID_UPDATES; i++) {
+            output = pid_update_double(output, errors[i] / 65536.0, errors[i - 1] / 65536.0, errors[i - 2] / 65536.0, kp, ki, kd);
+        }
+        double_sink = output;
+        uint32_t double_ns = timing_cycles() - start;
+        (void)fixed_sink;
+        (void)double_sink;
+
+        fprintf(stderr, "  %d     %.3g duty     %.2f / %.2f\n", r, worst,
+                (double)fixed_ns / BENCH_PID_UPDATES, (double)double_ns / BENCH_PID_UPDATES);
+        if (worst > BENCH_PID_TOLERANCE) failed = true;
+    }
+    return failed ? 1 : 0;
+}
+
+// every step within accel, from and back to standstill, never above the
+// maximum speed, and the setpoints add up to the distance
+static bool bench_profile_check(double distance, double max_speed, double accel)
+{
+    motion_profile_t profile;
+    motion_profile_plan(&profile, distance, max_speed, accel);
+    motion_distance_t planned = profile.remaining;
+    pid_value_t limit = PID_VALUE(accel);
+    pid_value_t top = PID_VALUE(max_speed > accel ? max_speed : accel);
+#if DC_MOTOR_FIXED_PID
+    pid_value_t slack = 0;
+#else
+    pid_value_t slack = 1e-9 * (max_speed + distance);
+#endif
+
+    motion_distance_t sum = 0;
+    pid_value_t last = 0;
+    pid_value_t worst = 0;
+    bool ok = true;
+    int64_t periods = 0;
+    while (profile.active) {
+        pid_value_t speed = motion_profile_next(&profile);
+        pid_value_t step = (speed > last) ? speed - last : last - speed;
+        if (step > worst) worst = step;
+        if (speed > top + slack) ok = false;
+        sum += speed;
+        last = speed;
+        if (++periods > 100000000) break;
+    }
+    if (last > worst) worst = last;
+    if (worst > limit + slack) ok = false;
+    if (profile.active || (fabs((double)(sum - planned)) > slack)) ok = false;
+    if (!ok) {
+        fprintf(stderr, "profile: distance %g max speed %g accel %g: largest step %g, sum off by %g, %lld periods\n",
+                distance, max_speed, accel, PID_VALUE_TO_DOUBLE(worst),
+                PID_VALUE_TO_DOUBLE(sum - planned), (long long)periods);
+    }
+    return ok;
+}
+
+static int bench_profile(void)
+{
+    static const double distances[] = { 0.3, 1, 3, 4, 5, 17, 101, 997, 12345.6, 80000, 2000000 };
+    static const double max_speeds[] = { 1, 4, 20, 100 };
+    static const double accels[] = { 0.04, 0.5, 4 };
+    int plans = 0;
+    int failed = 0;
+    for (int d = 0; d < sizeof(distances) / sizeof(distances[0]); d++) {
+        for (int v = 0; v < sizeof(max_speeds) / sizeof(max_speeds[0]); v++) {
+            for (int a = 0; a < sizeof(accels) / sizeof(accels[0]); a++) {
+                plans++;
+                if (!bench_profile_check(distances[d], max_speeds[v], accels[a])) failed++;
+            }
+        }
+    }
+    // random distances at the speeds of the axes
+    uint32_t seed = 1;
+    for (int i = 0; i < 10000; i++) {
+        double distance = (1 + bench_random(&seed)) * 50000;
+        plans++;
+        if (!bench_profile_check(distance, axes[0].dc_motor->slew_speed / CONTROL_RATE_HZ,
+                                 axes[0].dc_motor->slew_accel / CONTROL_RATE_HZ / CONTROL_RATE_HZ)) failed++;
+    }
+    fprintf(stderr, "%d of %d motion profiles failed\n", failed, plans);
+    return failed ? 1 : 0;
+}
+
+static int64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_env(const char *name, int otherwise)
+{
+    const char *env = getenv(name);
+    return env ? atoi(env) : otherwise;
+}
+
+// well formed commands the fuzzer starts from, leaving out the ones that
+// stream binary records to the UART
+static const char *const bench_fuzz_seeds[] = {
+    ":e1", ":a1", ":b2", ":j1", ":j2", ":f1", ":f2", ":g1", ":i2", ":h1", ":D1",
+    ":E1000080", ":F3", ":G100", ":G231", ":S1100000", ":I1060000", ":I2010000",
+    ":J1", ":J3", ":K1", ":K3", ":L2", ":O1", ":P10", ":V11",
+    ":X111", ":X121", ":X122", ":X1220100", ":X125", ":X1260200", ":X128",
+    ":X129", ":X1303200", ":X132", ":X14000", ":X141", ":X150", ":X151",
+};
+
+// one reply: '=' and hex digits or '!' and an error digit, then CR, within
+// SW_RESP_MAX and nothing written past it
+static bool bench_fuzz_reply(const char *resp, int len)
+{
+    if ((len < 2) || (len > SW_RESP_MAX)) return false;
+    if (resp[len - 1] != 0x0d) return false;
+    for (int i = SW_RESP_MAX; i < SW_RESP_MAX * 2; i++) {
+        if (resp[i] != (char)0xA5) return false;
+    }
+    if (resp[0] == '!') return (len == 3) && isxdigit((unsigned char)resp[1]);
+    if (resp[0] != '=') return false;
+    for (int i = 1; i < len - 1; i++) {
+        if (!isxdigit((unsigned char)resp[i]) || islower((unsigned char)resp[i])) return false;
+    }
+    return true;
+}
+
+// random bytes and mutated commands into the parser, every terminator after a
+// ':' must get exactly one well formed reply and nothing else may
+static int bench_fuzz(void)
+{
+    uint32_t seed = bench_env("SA_BENCH_SEED", 1);
+    int commands = bench_env("SA_BENCH_COMMANDS", BENCH_FUZZ_COMMANDS);
+    sw_parser_t parser = { .source = SW_SOURCE_UART };
+    char resp[SW_RESP_MAX * 2];
+    char cmd[32];
+    int failed = 0;
+
+    fprintf(stderr, "fuzz: seed %u, %d commands\n", seed, commands);
+    for (int n = 0; n < commands; n++) {
+        int len;
+        if (!bench_pick(&seed, 4)) {
+            // noise
+            len = 1 + bench_pick(&seed, sizeof(cmd) - 1);
+            for (int i = 0; i < len; i++) cmd[i] = (char)bench_pick(&seed, 128);
+        } else {
+            const char *base = bench_fuzz_seeds[bench_pick(&seed, sizeof(bench_fuzz_seeds) / sizeof(bench_fuzz_seeds[0]))];
+            len = strlen(base);
+            memcpy(cmd, base, len);
+            for (int m = bench_pick(&seed, 4); m > 0; m--) {
+                static const char mutations[] = "0123456789ABCDEFabx:\r\n 3";
+                int at = bench_pick(&seed, len + 1);
+                char ch = mutations[bench_pick(&seed, sizeof(mutations) - 1)];
+                switch (bench_pick(&seed, 3)) {
+                    case 0: // replace
+                        if (at < len) cmd[at] = ch;
+                        break;
+                    case 1: // insert
+                        if (len < sizeof(cmd) - 1) {
+                            memmove(cmd + at + 1, cmd + at, len - at);
+                            cmd[at] = ch;
+                            len++;
+                        }
+                        break;
+                    default: // truncate
+                        len = at;
+                        break;
+                }
+            }
+            cmd[len++] = 0x0d;
+        }
+
+        for (int i = 0; i < len; i++) {
+            bool pending = parser.state != 0;  // a ':' since the last terminator
+            bool terminator = (cmd[i] == 0x0d) || (cmd[i] == 0x0a);
+            memset(resp, 0xA5, sizeof(resp));
+            int reply = sw_parser_feed(&parser, cmd[i], resp);
+            bool ok = (pending && terminator) ? bench_fuzz_reply(resp, reply) : (reply == 0);
+            if (!ok && (failed++ < 10)) {
+                fprintf(stderr, "fuzz: command %d byte %d of \"", n, i);
+                for (int j = 0; j < len; j++) fprintf(stderr, isprint((unsigned char)cmd[j]) ? "%c" : "\\x%02X", (unsigned char)cmd[j]);
+                fprintf(stderr, "\": reply of %d\n", reply);
+            }
+        }
+    }
+
+    // leave the axes stopped
+    sw_parser_reset(&parser);
+    for (const char *p = ":L3\r"; *p; p++) sw_parser_feed(&parser, *p, resp);
+    fprintf(stderr, "fuzz: %d bad replies\n", failed);
+    return failed ? 1 : 0;
+}
+
+// commands per second through the parser and the handlers, the inquiries a
+// planetarium program polls with and an opcode the parser rejects itself
+static int bench_parser(void)
+{
+    static const char *const mixes[][4] = {
+        { ":j1\r", ":f1\r", ":j2\r", ":f2\r" },
+        { ":e1\r", ":a1\r", ":b1\r", ":g1\r" },
+        { ":z1\r", ":z1\r", ":z1\r", ":z1\r" },
+    };
+    static const char *const names[] = { "position and status", "constants", "unknown opcode" };
+    int commands = bench_env("SA_BENCH_COMMANDS", BENCH_PARSER_COMMANDS);
+    sw_parser_t parser = { .source = SW_SOURCE_UART };
+    char resp[SW_RESP_MAX];
+
+    for (int m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        volatile int sink = 0;
+        int64_t start = bench_now_ns();
+        for (int n = 0; n < commands; n++) {
+            for (const char *p = mixes[m][n & 3]; *p; p++) sink += sw_parser_feed(&parser, *p, resp);
+        }
+        int64_t ns = bench_now_ns() - start;
+        fprintf(stderr, "parser %-20s %.0f commands/s, %.0f ns per command\n",
+                names[m], commands * 1e9 / ns, (double)ns / commands);
+    }
+    return 0;
+}
+
+static int bench_pcnt_count(const bench_pcnt_channel_t *channel, int edge_level, int other_level)
+{
+    return (edge_level ? channel->rising : channel->falling) * (other_level ? channel->high : channel->low);
+}
+
+// quadrature sequences, forward, backward and a random walk, through the PCNT
+// actions and the edge decode of the HAL
+static int bench_encoder(void)
+{
+    uint32_t seed = bench_env("SA_BENCH_SEED", 1);
+    int enc1 = 0, enc2 = 0;
+    int32_t count = 0;
+    int edges = 0, wrong = 0;
+    for (int i = 0; i < BENCH_ENCODER_EDGES; i++) {
+        // 8 cycles each way, then random steps
+        int forward = (i < 32) ? 1 : (i < 64) ? 0 : bench_pick(&seed, 2);
+        // forward is 00 10 11 01: ENC1 changes when both are equal
+        bool first = (enc1 == enc2) == forward;
+        int32_t pcnt, decoded;
+        if (first) {
+            enc1 = !enc1;
+            pcnt = bench_pcnt_count(&bench_pcnt_enc1, enc1, enc2);
+            decoded = dc_motor_hal_enc1_direction(enc1, enc2);
+        }
+        else {
+            enc2 = !enc2;
+            pcnt = bench_pcnt_count(&bench_pcnt_enc2, enc2, enc1);
+            decoded = dc_motor_hal_enc2_direction(enc1, enc2);
+        }
+        count += pcnt;
+        edges++;
+        if (decoded != pcnt) wrong++;
+        if ((i == 31) && (abs(count) != 32)) wrong++;
+        if ((i == 63) && (count != 0)) wrong++;
+    }
+    fprintf(stderr, "encoder: %d of %d edges in the other direction than the PCNT count\n", wrong, edges);
+    return wrong ? 1 : 0;
+}
+
+void bench_init(void)
+{
+    bench = getenv("SA_BENCH");
+    if (!bench) return;
+    if (!strcmp(bench, "tracking")) {
+        tracking.motor = axes[0].dc_motor;
+        scheduler_add(bench_tracking_step, &tracking);
+    }
+}
+
+void bench_run(void)
+{
+    if (!bench) return;
+    if (!strcmp(bench, "tracking")) exit(bench_tracking());
+    if (!strcmp(bench, "pid")) exit(bench_pid());
+    if (!strcmp(bench, "profile")) exit(bench_profile());
+    if (!strcmp(bench, "fuzz")) exit(bench_fuzz());
+    if (!strcmp(bench, "parser")) exit(bench_parser());
+    if (!strcmp(bench, "encoder")) exit(bench_encoder());
+    fprintf(stderr, "bench: unknown SA_BENCH=%s\n", bench);
+    exit(2);
+}
+
+#endif
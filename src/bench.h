@@ -0,0 +1,38 @@
+#pragma once
+
+// host build only: measurements and checks run against the simulation
+// instead of serving EQMOD, selected by SA_BENCH. Each prints a report to
+// stderr and exits with 0 if it passed, 1 if not.
+//
+// SA_BENCH=tracking tracks at the sidereal rate for SA_BENCH_HOURS (1) of
+// simulated time and reports the tracking error of the simulated worm
+// against the commanded rate and the control step duration; with
+// SA_BENCH_LIMIT it fails if the peak error exceeds that many arcseconds.
+// Run it with SA_SIM_SPEEDUP=0.
+//
+// SA_BENCH=pid runs the fixed point and the double PID update side by side
+// in a closed loop with the gains of each regime, fails if their outputs
+// differ by more than BENCH_PID_TOLERANCE and reports the host time per
+// update of both.
+//
+// SA_BENCH=profile plans motion profiles over a grid of distances, speeds and
+// accelerations and fails if a speed step exceeds the acceleration, a speed
+// the maximum, or the setpoints do not add up to the distance.
+//
+// SA_BENCH=fuzz feeds SA_BENCH_COMMANDS (200000) random byte strings and
+// mutated commands, from SA_BENCH_SEED (1), into the EQMOD parser and fails
+// if a terminator after a ':' does not get exactly one well formed reply
+// within SW_RESP_MAX or any other byte gets one.
+//
+// SA_BENCH=parser reports the commands per second the parser and handlers
+// take for SA_BENCH_COMMANDS (1000000) of the polled inquiries.
+//
+// SA_BENCH=encoder steps the encoder inputs through quadrature sequences, from
+// SA_BENCH_SEED (1), and fails if the edge direction the HAL decodes differs
+// from the count the PCNT channel actions give.
+
+// before scheduler_start
+void bench_init(void);
+
+// from the comms task, returns at once unless SA_BENCH is set
+void bench_run(void);
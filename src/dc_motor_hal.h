@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "scheduler.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include "driver/pulse_cnt.h"
+#include "driver/mcpwm_prelude.h"
+#endif
+
+// PWM carrier and control loop sampling (see scheduler.h) are independent,
+// both can be set in build_flags
+#ifndef PWM_FREQUENCY_HZ
+#define PWM_FREQUENCY_HZ 20000    // above hearing
+#endif
+
+#define PWM_RESOLUTION_HZ 10000000
+#define PWM_PERIOD (PWM_RESOLUTION_HZ / PWM_FREQUENCY_HZ)
+
+#define DC_MOTOR_HAL_COUNT_LIMIT 30000
+#define DC_MOTOR_HAL_NO_WATCH INT32_MIN
+
+typedef enum {
+    DC_MOTOR_DRIVE_OFF,
+    DC_MOTOR_DRIVE_FORWARD,   // counter increases
+    DC_MOTOR_DRIVE_REVERSE,
+} dc_motor_drive_t;
+
+// every encoder transition is timestamped, one edge per count
+typedef struct {
+    int32_t edges;            // counted like the PCNT unit, but never reset
+    int32_t direction;        // of the last edge, +1 or -1
+    int64_t time;             // us, dc_motor_hal_get_time() time base
+} dc_motor_hal_edge_t;
+
+// direction of an encoder edge from the input levels after it, the way the
+// PCNT channels count it: channel A on ENC1 edges gated by ENC2, channel B
+// on ENC2 edges gated by ENC1
+static inline int32_t dc_motor_hal_enc1_direction(int enc1, int enc2)
+{
+    return (enc1 != enc2) ? 1 : -1;
+}
+
+static inline int32_t dc_motor_hal_enc2_direction(int enc1, int enc2)
+{
+    return (enc1 == enc2) ? 1 : -1;
+}
+
+// the callbacks run in interrupt context at CONTROL_INTR_PRIORITY, on_control
+// from the scheduler
+typedef struct {
+    bool (*on_control)(void *user_ctx);                 // every CONTROL_PERIOD_US
+    void (*on_overflow)(int32_t value, void *user_ctx); // counter reached +-DC_MOTOR_HAL_COUNT_LIMIT and was reset
+    void (*on_watch)(void *user_ctx);                   // counter reached the dc_motor_hal_set_watch value
+} dc_motor_hal_callbacks_t;
+
+#if CONFIG_IDF_TARGET_LINUX
+
+// simulated H-bridge, DC motor, worm gear and quadrature counter
+typedef struct {
+    dc_motor_hal_callbacks_t cbs;
+    void *user_ctx;
+
+    bool running;
+    dc_motor_drive_t drive;
+    int32_t compare;
+    int32_t compare_active; // latched on TEZ like the hardware comparator
+
+    int32_t count;
+    int32_t watch;
+    double position;        // continuous shaft position in encoder counts
+    double speed;           // counts per second
+    double play;            // taken up of the backlash, 0 driving the worm in reverse
+
+    dc_motor_hal_edge_t edge;
+} dc_motor_hal_t;
+
+#else
+
+typedef struct {
+    dc_motor_hal_callbacks_t cbs;
+    void *user_ctx;
+
+    mcpwm_timer_handle_t timer;
+    mcpwm_cmpr_handle_t comparator;
+    mcpwm_gen_handle_t generator1;
+    mcpwm_gen_handle_t generator2;
+    pcnt_unit_handle_t pcnt_unit;
+    int32_t watch;
+    bool running;
+
+    // written by the edge ISR, odd sequence while writing
+    uint32_t edge_seq;
+    dc_motor_hal_edge_t edge;
+} dc_motor_hal_t;
+
+#endif
+
+void dc_motor_hal_init(dc_motor_hal_t *hal, const dc_motor_hal_callbacks_t *cbs, void *user_ctx);
+
+void dc_motor_hal_start(dc_motor_hal_t *hal);
+void dc_motor_hal_stop(dc_motor_hal_t *hal);
+// stops the PWM timer and the counter so their PM locks allow light sleep,
+// with the control step suspended and the motor off
+void dc_motor_hal_suspend(dc_motor_hal_t *hal, bool suspend);
+void dc_motor_hal_set_drive(dc_motor_hal_t *hal, dc_motor_drive_t drive);
+void dc_motor_hal_set_compare(dc_motor_hal_t *hal, int32_t value);
+
+int32_t dc_motor_hal_get_count(dc_motor_hal_t *hal);
+// latest timestamped encoder edge
+void dc_motor_hal_get_edge(dc_motor_hal_t *hal, dc_motor_hal_edge_t *edge);
+void dc_motor_hal_clear_count(dc_motor_hal_t *hal);
+// an extra PCNT watch point, task context; within the count limits and not
+// 0, DC_MOTOR_HAL_NO_WATCH removes it. on_watch may still come from the
+// previous value, check the count there
+void dc_motor_hal_set_watch(dc_motor_hal_t *hal, int32_t value);
+
+// microseconds, simulated time on the host
+int64_t dc_motor_hal_get_time(void);
+
+#if CONFIG_IDF_TARGET_LINUX
+// real (not quantized) position of the worm side of the simulated backlash,
+// in counts, for the tracking error measurement
+double dc_motor_hal_sim_get_worm(dc_motor_hal_t *hal);
+#endif
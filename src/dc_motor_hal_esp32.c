@@ -0,0 +1,259 @@
+#include "sdkconfig.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
+#include "dc_motor_hal.h"
+
+const gpio_num_t MOTOR1_GPIO = (gpio_num_t)12;
+const gpio_num_t MOTOR2_GPIO = (gpio_num_t)13;
+const gpio_num_t ENC1_GPIO = (gpio_num_t)14;
+const gpio_num_t ENC2_GPIO = (gpio_num_t)15;
+
+
+static bool IRAM_ATTR pcnt_on_reach(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx)
+{
+    dc_motor_hal_t *hal = (dc_motor_hal_t *)user_ctx;
+    int32_t value = edata->watch_point_value;
+    if ((value == DC_MOTOR_HAL_COUNT_LIMIT) || (value == -DC_MOTOR_HAL_COUNT_LIMIT)) hal->cbs.on_overflow(value, hal->user_ctx);
+    else hal->cbs.on_watch(hal->user_ctx);
+    return false;
+}
+
+// direction decoded the same way as the PCNT channels
+static void IRAM_ATTR encoder_edge(dc_motor_hal_t *hal, int32_t direction)
+{
+    uint32_t seq = hal->edge_seq;
+    __atomic_store_n(&hal->edge_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    hal->edge.edges += direction;
+    hal->edge.direction = direction;
+    hal->edge.time = esp_timer_get_time();
+
+    __atomic_store_n(&hal->edge_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void IRAM_ATTR enc1_edge(void *user_ctx)
+{
+    encoder_edge((dc_motor_hal_t *)user_ctx, dc_motor_hal_enc1_direction(gpio_get_level(ENC1_GPIO), gpio_get_level(ENC2_GPIO)));
+}
+
+static void IRAM_ATTR enc2_edge(void *user_ctx)
+{
+    encoder_edge((dc_motor_hal_t *)user_ctx, dc_motor_hal_enc2_direction(gpio_get_level(ENC1_GPIO), gpio_get_level(ENC2_GPIO)));
+}
+
+static bool IRAM_ATTR control_callback(void *user_ctx)
+{
+    dc_motor_hal_t *hal = (dc_motor_hal_t *)user_ctx;
+    if (!hal->running) return false;
+    return hal->cbs.on_control(hal->user_ctx);
+}
+
+
+void dc_motor_hal_init(dc_motor_hal_t *hal, const dc_motor_hal_callbacks_t *cbs, void *user_ctx)
+{
+    hal->cbs = *cbs;
+    hal->user_ctx = user_ctx;
+    hal->watch = DC_MOTOR_HAL_NO_WATCH;
+
+    pcnt_unit_config_t unit_config = {
+        .high_limit = DC_MOTOR_HAL_COUNT_LIMIT,
+        .low_limit = -DC_MOTOR_HAL_COUNT_LIMIT,
+        .intr_priority = CONTROL_INTR_PRIORITY,
+    };
+    ESP_ERROR_CHECK(pcnt_new_unit(&unit_config, &hal->pcnt_unit));
+
+    pcnt_glitch_filter_config_t filter_config = {
+        .max_glitch_ns = 2000,
+    };
+    ESP_ERROR_CHECK(pcnt_unit_set_glitch_filter(hal->pcnt_unit, &filter_config));
+
+    pcnt_chan_config_t chan_a_config = {
+        .edge_gpio_num = ENC1_GPIO,
+        .level_gpio_num = ENC2_GPIO,
+    };
+    pcnt_channel_handle_t pcnt_chan_a = NULL;
+    ESP_ERROR_CHECK(pcnt_new_channel(hal->pcnt_unit, &chan_a_config, &pcnt_chan_a));
+    pcnt_chan_config_t chan_b_config = {
+        .edge_gpio_num = ENC2_GPIO,
+        .level_gpio_num = ENC1_GPIO,
+    };
+    pcnt_channel_handle_t pcnt_chan_b = NULL;
+    ESP_ERROR_CHECK(pcnt_new_channel(hal->pcnt_unit, &chan_b_config, &pcnt_chan_b));
+
+    // keep dc_motor_hal_enc1_direction, dc_motor_hal_enc2_direction and the
+    // model in bench.c in step with these
+    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan_a, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
+    ESP_ERROR_CHECK(pcnt_channel_set_level_action(pcnt_chan_a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE));
+    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan_b, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE));
+    ESP_ERROR_CHECK(pcnt_channel_set_level_action(pcnt_chan_b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE));
+
+    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(hal->pcnt_unit, DC_MOTOR_HAL_COUNT_LIMIT));
+    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(hal->pcnt_unit, -DC_MOTOR_HAL_COUNT_LIMIT));
+    pcnt_event_callbacks_t pcnt_cbs = {
+        .on_reach = pcnt_on_reach, // accumulate the overflow in the callback
+    };
+    ESP_ERROR_CHECK(pcnt_unit_register_event_callbacks(hal->pcnt_unit, &pcnt_cbs, hal));
+
+
+    ESP_ERROR_CHECK(pcnt_unit_enable(hal->pcnt_unit));
+    ESP_ERROR_CHECK(pcnt_unit_clear_count(hal->pcnt_unit));
+    ESP_ERROR_CHECK(pcnt_unit_start(hal->pcnt_unit));
+
+    // the PCNT inputs keep working, the GPIO interrupts only add the edge times
+    hal->edge_seq = 0;
+    hal->edge.edges = 0;
+    hal->edge.direction = 1;
+    hal->edge.time = 0;
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    ESP_ERROR_CHECK(gpio_set_intr_type(ENC1_GPIO, GPIO_INTR_ANYEDGE));
+    ESP_ERROR_CHECK(gpio_set_intr_type(ENC2_GPIO, GPIO_INTR_ANYEDGE));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(ENC1_GPIO, enc1_edge, hal));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(ENC2_GPIO, enc2_edge, hal));
+    ESP_ERROR_CHECK(gpio_intr_enable(ENC1_GPIO));
+    ESP_ERROR_CHECK(gpio_intr_enable(ENC2_GPIO));
+
+
+
+    mcpwm_timer_config_t timer_config = {
+        .group_id = 0,
+        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
+        .resolution_hz = PWM_RESOLUTION_HZ,
+        .period_ticks = PWM_PERIOD,
+        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &hal->timer));
+
+    mcpwm_oper_handle_t oper = NULL;
+    mcpwm_operator_config_t operator_config = {
+        .group_id = 0, // operator must be in the same group to the timer
+    };
+    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &oper));
+
+    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(oper, hal->timer));
+
+    mcpwm_comparator_config_t comparator_config = {
+        .flags.update_cmp_on_tez = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_comparator(oper, &comparator_config, &hal->comparator));
+
+    mcpwm_generator_config_t generator_config = {
+        .gen_gpio_num = MOTOR1_GPIO,
+        .flags.invert_pwm = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_generator(oper, &generator_config, &hal->generator1));
+
+    // go low on compare threshold
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(hal->generator1,
+                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, hal->comparator, MCPWM_GEN_ACTION_LOW),
+                    MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+
+    generator_config.gen_gpio_num = MOTOR2_GPIO;
+
+    ESP_ERROR_CHECK(mcpwm_new_generator(oper, &generator_config, &hal->generator2));
+    // go low on compare threshold
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(hal->generator2,
+                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, hal->comparator, MCPWM_GEN_ACTION_LOW),
+                    MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+
+    // both outputs low on counter empty until started
+    dc_motor_hal_set_drive(hal, DC_MOTOR_DRIVE_OFF);
+
+    ESP_ERROR_CHECK(mcpwm_timer_enable(hal->timer));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(hal->comparator, 0));
+
+
+    // the control step runs from the common scheduler, the new compare value is taken on the next TEZ
+    hal->running = false;
+    scheduler_add(control_callback, hal);
+}
+
+void dc_motor_hal_start(dc_motor_hal_t *hal)
+{
+    ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_START_NO_STOP));
+    hal->running = true;
+}
+
+void dc_motor_hal_stop(dc_motor_hal_t *hal)
+{
+    hal->running = false;
+    ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_STOP_FULL));
+    dc_motor_hal_set_drive(hal, DC_MOTOR_DRIVE_OFF);
+}
+
+void dc_motor_hal_suspend(dc_motor_hal_t *hal, bool suspend)
+{
+    // the count is kept, a stopped worm gear does not move
+    if (suspend) {
+        ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_STOP_FULL));
+        ESP_ERROR_CHECK(mcpwm_timer_disable(hal->timer));
+        ESP_ERROR_CHECK(pcnt_unit_stop(hal->pcnt_unit));
+        ESP_ERROR_CHECK(pcnt_unit_disable(hal->pcnt_unit));
+    }
+    else {
+        ESP_ERROR_CHECK(pcnt_unit_enable(hal->pcnt_unit));
+        ESP_ERROR_CHECK(pcnt_unit_start(hal->pcnt_unit));
+        ESP_ERROR_CHECK(mcpwm_timer_enable(hal->timer));
+        if (hal->running) ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_START_NO_STOP));
+    }
+}
+
+void dc_motor_hal_set_drive(dc_motor_hal_t *hal, dc_motor_drive_t drive)
+{
+    // the driven output goes high on counter empty, the other one stays low
+    mcpwm_generator_action_t action1 = (drive == DC_MOTOR_DRIVE_FORWARD) ? MCPWM_GEN_ACTION_HIGH : MCPWM_GEN_ACTION_LOW;
+    mcpwm_generator_action_t action2 = (drive == DC_MOTOR_DRIVE_REVERSE) ? MCPWM_GEN_ACTION_HIGH : MCPWM_GEN_ACTION_LOW;
+
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(hal->generator1,
+                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, action1),
+                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(hal->generator2,
+                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, action2),
+                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+}
+
+void IRAM_ATTR dc_motor_hal_set_compare(dc_motor_hal_t *hal, int32_t value)
+{
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(hal->comparator, value));
+}
+
+int32_t IRAM_ATTR dc_motor_hal_get_count(dc_motor_hal_t *hal)
+{
+    int pulse_count_hw;
+    ESP_ERROR_CHECK(pcnt_unit_get_count(hal->pcnt_unit, &pulse_count_hw));
+    return pulse_count_hw;
+}
+
+void IRAM_ATTR dc_motor_hal_get_edge(dc_motor_hal_t *hal, dc_motor_hal_edge_t *edge)
+{
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&hal->edge_seq, __ATOMIC_ACQUIRE);
+        *edge = hal->edge;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&hal->edge_seq, __ATOMIC_RELAXED)));
+}
+
+void dc_motor_hal_clear_count(dc_motor_hal_t *hal)
+{
+    ESP_ERROR_CHECK(pcnt_unit_clear_count(hal->pcnt_unit));
+}
+
+void dc_motor_hal_set_watch(dc_motor_hal_t *hal, int32_t value)
+{
+    if (hal->watch != DC_MOTOR_HAL_NO_WATCH) ESP_ERROR_CHECK(pcnt_unit_remove_watch_point(hal->pcnt_unit, hal->watch));
+    hal->watch = value;
+    if (value != DC_MOTOR_HAL_NO_WATCH) ESP_ERROR_CHECK(pcnt_unit_add_watch_point(hal->pcnt_unit, value));
+}
+
+int64_t IRAM_ATTR dc_motor_hal_get_time(void)
+{
+    return esp_timer_get_time();
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "dc_motor_hal.h"
+#include "motor.h"
+
+// plant model, roughly the Star Adventurer motor with its encoder
+#define SIM_MAX_SPEED 8000.0      // counts/s at full duty
+#define SIM_TIME_CONSTANT 0.030   // s, mechanical time constant
+#define SIM_FRICTION 0.02         // duty needed to break away
+#define SIM_WORM_LOAD 0.004       // periodic load of the worm, in duty
+#define SIM_FREE_FRICTION 0.005   // duty to turn the motor alone, in the backlash
+
+// SA_SIM_BACKLASH sets the play between the motor and the worm in counts
+static double sim_backlash;
+
+
+static void sim_count(dc_motor_hal_t *hal, int32_t delta)
+{
+    // the PCNT unit resets to zero when it reaches a limit and reports the watch point
+    while (delta != 0) {
+        int32_t step = (delta > 0) ? 1 : -1;
+        hal->count += step;
+        delta -= step;
+        if (hal->count == DC_MOTOR_HAL_COUNT_LIMIT || hal->count == -DC_MOTOR_HAL_COUNT_LIMIT) {
+            int32_t value = hal->count;
+            hal->count = 0;
+            hal->cbs.on_overflow(value, hal->user_ctx);
+        }
+        else if (hal->count == __atomic_load_n(&hal->watch, __ATOMIC_RELAXED)) {
+            hal->cbs.on_watch(hal->user_ctx);
+        }
+    }
+}
+
+static void sim_plant(dc_motor_hal_t *hal, double t, double dt)
+{
+    double duty = 0;
+    if (hal->running) {
+        duty = (double)hal->compare_active / PWM_PERIOD;
+        if (hal->drive == DC_MOTOR_DRIVE_REVERSE) duty = -duty;
+        else if (hal->drive == DC_MOTOR_DRIVE_OFF) duty = 0;
+    }
+
+    // the worm is driven once the motor pushes against either end of the play
+    bool engaged = (sim_backlash == 0) || ((duty > 0) && (hal->play >= sim_backlash)) || ((duty < 0) && (hal->play <= 0));
+    double friction = SIM_FREE_FRICTION;
+    if (engaged) {
+        duty -= SIM_WORM_LOAD * sin(2 * M_PI * (hal->position - hal->play) / DC_WORM_PERIOD);
+        friction = SIM_FRICTION;
+    }
+
+    double drive = 0;
+    if (duty > friction) drive = duty - friction;
+    if (duty < -friction) drive = duty + friction;
+
+    hal->speed += (SIM_MAX_SPEED * drive - hal->speed) * dt / SIM_TIME_CONSTANT;
+
+    double start = hal->position;
+    int32_t before = (int32_t)floor(start);
+    hal->position += hal->speed * dt;
+    hal->play += hal->speed * dt;
+    if (hal->play > sim_backlash) hal->play = sim_backlash;
+    if (hal->play < 0) hal->play = 0;
+    sim_count(hal, (int32_t)floor(hal->position) - before);
+
+    // time of the last count boundary crossed, interpolated within the step
+    int32_t after = (int32_t)floor(hal->position);
+    if (after != before) {
+        double at = (after > before) ? after : after + 1;
+        hal->edge.edges += after - before;
+        hal->edge.direction = (after > before) ? 1 : -1;
+        hal->edge.time = (int64_t)((t + dt * (at - start) / (hal->position - start)) * 1e6);
+    }
+}
+
+// one control period, the plant is integrated once per PWM period with the average duty
+// up to the time the scheduler advanced to
+static bool sim_control(void *user_ctx)
+{
+    dc_motor_hal_t *hal = (dc_motor_hal_t *)user_ctx;
+    const double dt = 1.0 / PWM_FREQUENCY_HZ;
+    int64_t start_us = scheduler_get_time() - CONTROL_PERIOD_US;
+
+    for (int i = 0; i < PWM_FREQUENCY_HZ / CONTROL_RATE_HZ; i++) {
+        // comparator update on TEZ
+        hal->compare_active = hal->compare;
+        sim_plant(hal, start_us * 1e-6 + i * dt, dt);
+    }
+
+    if (!hal->running) return false;
+    return hal->cbs.on_control(hal->user_ctx);
+}
+
+
+void dc_motor_hal_init(dc_motor_hal_t *hal, const dc_motor_hal_callbacks_t *cbs, void *user_ctx)
+{
+    hal->cbs = *cbs;
+    hal->user_ctx = user_ctx;
+    hal->running = false;
+    hal->drive = DC_MOTOR_DRIVE_OFF;
+    hal->compare = 0;
+    hal->compare_active = 0;
+    hal->count = 0;
+    hal->watch = DC_MOTOR_HAL_NO_WATCH;
+    hal->position = 0;
+    hal->play = 0;
+    hal->speed = 0;
+    hal->edge.edges = 0;
+    hal->edge.direction = 1;
+    hal->edge.time = 0;
+
+    const char *env = getenv("SA_SIM_BACKLASH");
+    sim_backlash = env ? atof(env) : 0;
+
+    scheduler_add(sim_control, hal);
+}
+
+void dc_motor_hal_start(dc_motor_hal_t *hal)
+{
+    hal->running = true;
+}
+
+void dc_motor_hal_stop(dc_motor_hal_t *hal)
+{
+    hal->running = false;
+    hal->drive = DC_MOTOR_DRIVE_OFF;
+}
+
+void dc_motor_hal_suspend(dc_motor_hal_t *hal, bool suspend)
+{
+    // the plant is at rest and catches up in the next control step
+}
+
+void dc_motor_hal_set_drive(dc_motor_hal_t *hal, dc_motor_drive_t drive)
+{
+    hal->drive = drive;
+}
+
+void dc_motor_hal_set_compare(dc_motor_hal_t *hal, int32_t value)
+{
+    hal->compare = value;
+}
+
+int32_t dc_motor_hal_get_count(dc_motor_hal_t *hal)
+{
+    return hal->count;
+}
+
+void dc_motor_hal_get_edge(dc_motor_hal_t *hal, dc_motor_hal_edge_t *edge)
+{
+    *edge = hal->edge;
+}
+
+void dc_motor_hal_clear_count(dc_motor_hal_t *hal)
+{
+    hal->count = 0;
+}
+
+void dc_motor_hal_set_watch(dc_motor_hal_t *hal, int32_t value)
+{
+    __atomic_store_n(&hal->watch, value, __ATOMIC_RELAXED);
+}
+
+int64_t dc_motor_hal_get_time(void)
+{
+    return scheduler_get_time();
+}
+
+double dc_motor_hal_sim_get_worm(dc_motor_hal_t *hal)
+{
+    return hal->position - hal->play;
+}
+
+#endif
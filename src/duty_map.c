@@ -0,0 +1,171 @@
+#include <math.h>
+#include <string.h>
+#include "nvs.h"
+#include "esp_attr.h"
+
+#include "duty_map.h"
+#include "scheduler.h"
+
+#define DUTY_MAP_NVS_NAMESPACE "dutymap"
+#define DUTY_MAP_NVS_KEY "table"
+
+// stored as Q30 duty with the grid it was learned on
+typedef struct {
+    int32_t min_speed;                           // counts per second
+    uint32_t valid[2];
+    int32_t duty[2][DUTY_MAP_POINTS];
+} duty_map_blob_t;
+
+static void duty_map_store(const duty_map_t *map)
+{
+    duty_map_blob_t blob = {
+        .min_speed = DUTY_MAP_MIN_SPEED,
+    };
+    for (int d = 0; d < 2; d++) {
+        blob.valid[d] = __atomic_load_n(&map->valid[d], __ATOMIC_ACQUIRE);
+        for (int i = 0; i < DUTY_MAP_POINTS; i++) blob.duty[d][i] = PID_GAIN_TO_DOUBLE(map->duty[d][i]) * (1 << 30);
+    }
+
+    nvs_handle_t handle;
+    if (nvs_open(DUTY_MAP_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_set_blob(handle, DUTY_MAP_NVS_KEY, &blob, sizeof(blob));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static void duty_map_load(duty_map_t *map)
+{
+    duty_map_blob_t blob;
+    size_t len = sizeof(blob);
+
+    nvs_handle_t handle;
+    if (nvs_open(DUTY_MAP_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return;
+    esp_err_t err = nvs_get_blob(handle, DUTY_MAP_NVS_KEY, &blob, &len);
+    nvs_close(handle);
+    if ((err != ESP_OK) || (len != sizeof(blob)) || (blob.min_speed != (int32_t)DUTY_MAP_MIN_SPEED)) return;
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUTY_MAP_POINTS; i++) map->duty[d][i] = PID_GAIN((double)blob.duty[d][i] / (1 << 30));
+        map->valid[d] = blob.valid[d];
+    }
+}
+
+void duty_map_init(duty_map_t *map)
+{
+    memset(map, 0, sizeof(*map));
+    for (int i = 0; i < DUTY_MAP_POINTS; i++) {
+        map->speed[i] = PID_VALUE(DUTY_MAP_MIN_SPEED * pow(2, i / 2.0) / CONTROL_RATE_HZ);
+    }
+    duty_map_load(map);
+}
+
+// duty between two points, weight Q16 from d0 towards d1
+static inline pid_gain_t IRAM_ATTR duty_map_blend(pid_gain_t d0, pid_gain_t d1, int32_t weight)
+{
+#if DC_MOTOR_FIXED_PID
+    return d0 + (pid_gain_t)(((int64_t)(d1 - d0) * weight) >> 16);
+#else
+    return d0 + (d1 - d0) * weight / 65536;
+#endif
+}
+
+static inline int32_t IRAM_ATTR duty_map_weight(pid_value_t speed, pid_value_t s0, pid_value_t s1)
+{
+#if DC_MOTOR_FIXED_PID
+    return ((int64_t)(speed - s0) << 16) / (s1 - s0);
+#else
+    return (speed - s0) * 65536 / (s1 - s0);
+#endif
+}
+
+bool IRAM_ATTR duty_map_lookup(const duty_map_t *map, bool direction, pid_value_t speed, pid_gain_t *duty)
+{
+    uint32_t valid = __atomic_load_n(&map->valid[direction], __ATOMIC_ACQUIRE);
+    if (!valid) return false;
+
+    // nearest learned points at or below and above the speed
+    int lo = -1;
+    int hi = -1;
+    for (int i = 0; i < DUTY_MAP_POINTS; i++) {
+        if (!(valid & (1u << i))) continue;
+        if (map->speed[i] <= speed) lo = i;
+        else {
+            hi = i;
+            break;
+        }
+    }
+
+    const pid_gain_t *d = map->duty[direction];
+    if (hi < 0) {
+        *duty = d[lo];
+    }
+    else if (lo >= 0) {
+        *duty = duty_map_blend(d[lo], d[hi], duty_map_weight(speed, map->speed[lo], map->speed[hi]));
+    }
+    else {
+        // below everything learned: down along the two lowest points to the
+        // friction they imply, or towards zero at standstill with only one
+        int next = hi + 1;
+        while ((next < DUTY_MAP_POINTS) && !(valid & (1u << next))) next++;
+        pid_gain_t x;
+        if (next < DUTY_MAP_POINTS) x = duty_map_blend(d[hi], d[next], duty_map_weight(speed, map->speed[hi], map->speed[next]));
+        else x = duty_map_blend(0, d[hi], duty_map_weight(speed < 0 ? 0 : speed, 0, map->speed[hi]));
+        if (x < 0) x = 0;
+        if (x > d[hi]) x = d[hi];
+        *duty = x;
+    }
+    return true;
+}
+
+void duty_map_learn(duty_map_t *map, bool direction, pid_value_t speed, pid_gain_t duty)
+{
+    if (speed <= 0) return;
+
+    // the points around the speed, the nearer one in ratio starts from the sample
+    int i = 0;
+    while ((i < DUTY_MAP_POINTS - 2) && (map->speed[i + 1] <= speed)) i++;
+    if (speed < map->speed[0]) return;
+    if (speed > map->speed[DUTY_MAP_POINTS - 1]) i = DUTY_MAP_POINTS - 2;
+    int near = ((double)speed * speed >= (double)map->speed[i] * map->speed[i + 1]) ? i + 1 : i;
+
+    pid_gain_t *d = map->duty[direction];
+    uint32_t valid = map->valid[direction];
+    if (!(valid & (1u << near))) {
+        d[near] = duty;
+        __atomic_store_n(&map->valid[direction], valid | (1u << near), __ATOMIC_RELEASE);
+        map->dirty = true;
+        return;
+    }
+
+    // gradient step on the interpolation error, shared by the two points
+    pid_gain_t predicted;
+    duty_map_lookup(map, direction, speed, &predicted);
+    double error = PID_GAIN_TO_DOUBLE(duty - predicted) / (1 << DUTY_MAP_LEARN_SHIFT);
+    double w = (double)(speed - map->speed[i]) / (map->speed[i + 1] - map->speed[i]);
+    if (w < 0) w = 0;
+    if (w > 1) w = 1;
+    if (valid & (1u << i)) d[i] += PID_GAIN(error * (1 - w));
+    if (valid & (1u << (i + 1))) d[i + 1] += PID_GAIN(error * w);
+    map->dirty = true;
+}
+
+void duty_map_save(duty_map_t *map)
+{
+    int64_t now = scheduler_get_time();
+    if (!map->dirty || (map->saved_time && (now - map->saved_time < DUTY_MAP_SAVE_INTERVAL_S * 1000000LL))) return;
+    map->dirty = false;
+    map->saved_time = now;
+    duty_map_store(map);
+}
+
+void duty_map_clear(duty_map_t *map)
+{
+    for (int d = 0; d < 2; d++) __atomic_store_n(&map->valid[d], 0, __ATOMIC_RELEASE);
+    map->dirty = false;
+
+    nvs_handle_t handle;
+    if (nvs_open(DUTY_MAP_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_erase_key(handle, DUTY_MAP_NVS_KEY);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
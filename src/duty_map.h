@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pid.h"
+
+// learned feedforward: the steady state PID output per speed and direction.
+// The ISR starts a run from it and follows it when the speed setpoint
+// changes, so the PID only integrates the residual. Points are spaced by a
+// factor of sqrt(2) in speed from DUTY_MAP_MIN_SPEED, interpolated linearly
+// between the learned ones and extrapolated down to the friction duty below.
+#define DUTY_MAP_POINTS 16
+#define DUTY_MAP_MIN_SPEED 25.0   // counts per second, a quarter of sidereal
+
+// learning weight per sample, 1/2^shift
+#define DUTY_MAP_LEARN_SHIFT 8
+// stored at the next start or stop when learned, at most this often
+#define DUTY_MAP_SAVE_INTERVAL_S 600
+
+typedef struct {
+    pid_value_t speed[DUTY_MAP_POINTS];          // counts per period
+    pid_gain_t duty[2][DUTY_MAP_POINTS];         // per direction, PID output
+    uint32_t valid[2];                           // bit per point
+
+    bool dirty;
+    int64_t saved_time;                          // us
+} duty_map_t;
+
+// loads the stored map from NVS
+void duty_map_init(duty_map_t *map);
+
+// control ISR, speed in the run direction; false while nothing was learned
+// for the direction
+bool duty_map_lookup(const duty_map_t *map, bool direction, pid_value_t speed, pid_gain_t *duty);
+
+// control task, the PID output settled at speed
+void duty_map_learn(duty_map_t *map, bool direction, pid_value_t speed, pid_gain_t duty);
+
+// task context, stores the map if it was learned and the interval passed
+void duty_map_save(duty_map_t *map);
+// forgets everything learned, also in NVS
+void duty_map_clear(duty_map_t *map);
@@ -0,0 +1,116 @@
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <unistd.h>
+#else
+#include "driver/uart.h"
+#include "esp_sleep.h"
+#endif
+
+#include "eqmod_uart.h"
+#include "sw_protocol.h"
+#include "timing.h"
+#include "power.h"
+#include "replay.h"
+
+#define EQMOD_UART UART_NUM_0
+
+#define RX_BUFFER 512 // driver side
+#define RX_CHUNK 128
+
+#if CONFIG_IDF_TARGET_LINUX
+static bool stdin_closed;
+#else
+static QueueHandle_t uart_queue;
+#endif
+
+static sw_parser_t parser;
+static char rx[RX_CHUNK];
+static char resp[SW_RESP_MAX];
+
+
+void eqmod_uart_write(const char *buf, int len)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    write(STDOUT_FILENO, buf, len);
+#else
+    uart_write_bytes(EQMOD_UART, buf, len);
+#endif
+}
+
+static void receive(uint32_t t_rx)
+{
+    while (1) {
+#if CONFIG_IDF_TARGET_LINUX
+        int rd = read(STDIN_FILENO, rx, sizeof(rx));
+        if (rd == 0) stdin_closed = true;
+#else
+        int rd = uart_read_bytes(EQMOD_UART, rx, sizeof(rx), 0);
+#endif
+        if (rd <= 0) break;
+        replay_record('>', rx, rd);
+
+        for (int i = 0; i < rd; i++) {
+            int len = sw_parser_feed(&parser, rx[i], resp);
+            if (len) {
+                eqmod_uart_write(resp, len);
+                replay_record('<', resp, len);
+                timing_record(TIMING_UART_REPLY, timing_cycles() - t_rx);
+            }
+        }
+#if CONFIG_IDF_TARGET_LINUX
+        break;
+#endif
+    }
+}
+
+void eqmod_uart_init(void)
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    ESP_ERROR_CHECK(uart_driver_install(EQMOD_UART, RX_BUFFER, 0, 16, &uart_queue, 0));
+#if CONFIG_PM_ENABLE
+    // the characters waking it are lost, the host repeats the command
+    ESP_ERROR_CHECK(uart_set_wakeup_threshold(EQMOD_UART, 3));
+    ESP_ERROR_CHECK(esp_sleep_enable_uart_wakeup(EQMOD_UART));
+#endif
+#endif
+}
+
+void eqmod_uart_poll(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    // read() returns at once at the end of input, the simulation goes on
+    // serving UDP without it
+    if (stdin_closed) {
+        vTaskSuspend(NULL);
+        return;
+    }
+    receive(timing_cycles());
+#else
+    // light sleep is held off while the host is talking
+    uart_event_t event;
+    if (xQueueReceive(uart_queue, &event, pdMS_TO_TICKS(POWER_UART_HOLD_MS)) != pdTRUE) {
+        power_uart_idle();
+        return;
+    }
+    uint32_t t_rx = timing_cycles();
+    power_uart_activity();
+
+    switch (event.type) {
+        case UART_DATA:
+            receive(t_rx);
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            uart_flush_input(EQMOD_UART);
+            xQueueReset(uart_queue);
+            sw_parser_reset(&parser);
+            break;
+        default:
+            break;
+    }
+#endif
+}
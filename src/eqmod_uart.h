@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+void eqmod_uart_init(void);
+
+// wait for input and handle all complete commands
+void eqmod_uart_poll(void);
+
+// raw bytes, shared with the replies
+void eqmod_uart_write(const char *buf, int len);
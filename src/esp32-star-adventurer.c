@@ -9,235 +9,729 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "driver/gpio.h"
 #include "sdkconfig.h"
-#include "esp_timer.h"
+#include "esp_attr.h"
+#include "nvs_flash.h"
+#include "nvs.h"
 
 #include "motor.h"
+#include "stepper.h"
+#include "axis.h"
+#include "scheduler.h"
+#include "st4.h"
+#include "persist.h"
+#include "eqmod_uart.h"
+#include "sw_protocol.h"
+#include "udp_server.h"
+#include "telemetry.h"
+#include "power.h"
+#include "stream.h"
+#include "replay.h"
+#include "bench.h"
+
+
+#if DC_MOTOR_FIXED_PID
+
+static int32_t IRAM_ATTR pid(dc_motor_context_t *dc_motor_context, pid_value_t error)
+{
+    dc_motor_context->pid_output = pid_update_fixed(dc_motor_context->pid_output, error,
+                                                    dc_motor_context->prev_error, dc_motor_context->prev_error2,
+                                                    dc_motor_context->Kp, dc_motor_context->Ki, dc_motor_context->Kd);
+    dc_motor_context->prev_error2 = dc_motor_context->prev_error;
+    dc_motor_context->prev_error = error;
+    return ((int64_t)dc_motor_context->pid_output * PWM_PERIOD) >> PID_GAIN_SHIFT;
+}
 
-const gpio_num_t MOTOR1_GPIO = (gpio_num_t)12;
-const gpio_num_t MOTOR2_GPIO = (gpio_num_t)13;
-const gpio_num_t ENC1_GPIO = (gpio_num_t)14;
-const gpio_num_t ENC2_GPIO = (gpio_num_t)15;
-
-TaskHandle_t task_to_notify = NULL;
-
-
-
-const int32_t PWM_PERIOD = 50000;
-const int32_t PWM_CB_AT = 48000;
-const int32_t PWM_RESOLUTION_HZ = 1000000;
+static int32_t IRAM_ATTR output_to_compare(pid_gain_t output)
+{
+    return ((int64_t)output * PWM_PERIOD) >> PID_GAIN_SHIFT;
+}
 
+static void IRAM_ATTR add_output(dc_motor_context_t *dc_motor_context, pid_gain_t delta)
+{
+    int64_t output = (int64_t)dc_motor_context->pid_output + delta;
+    if (output < 0) output = 0;
+    if (output > (1 << PID_GAIN_SHIFT)) output = 1 << PID_GAIN_SHIFT;
+    dc_motor_context->pid_output = output;
+}
 
-dc_motor_context_t dc_motor_context = {
-    .target_speed = 5,
-    .Kp = 0.0030,
-    .Ki = 0.0003,
-    .Kd = 0.0010,
-};
+#else
 
-static int32_t pid(dc_motor_context_t *dc_motor_context, double error)
+static int32_t IRAM_ATTR pid(dc_motor_context_t *dc_motor_context, pid_value_t error)
 {
-    dc_motor_context->pid_output += error * dc_motor_context->Ki + 
-                  (error - dc_motor_context->prev_error) * dc_motor_context->Kp +
-                  (error - 2 * dc_motor_context->prev_error + dc_motor_context->prev_error2) * dc_motor_context->Kd;
-                  
+    dc_motor_context->pid_output = pid_update_double(dc_motor_context->pid_output, error,
+                                                     dc_motor_context->prev_error, dc_motor_context->prev_error2,
+                                                     dc_motor_context->Kp, dc_motor_context->Ki, dc_motor_context->Kd);
     dc_motor_context->prev_error2 = dc_motor_context->prev_error;
     dc_motor_context->prev_error = error;
+    return dc_motor_context->pid_output * PWM_PERIOD;
+}
 
+static int32_t IRAM_ATTR output_to_compare(pid_gain_t output)
+{
+    return output * PWM_PERIOD;
+}
 
+static void IRAM_ATTR add_output(dc_motor_context_t *dc_motor_context, pid_gain_t delta)
+{
+    dc_motor_context->pid_output += delta;
     if (dc_motor_context->pid_output < 0) dc_motor_context->pid_output = 0;
     if (dc_motor_context->pid_output > 1) dc_motor_context->pid_output = 1;
-    return dc_motor_context->pid_output * PWM_PERIOD;
 }
 
-static bool pcnt_on_reach(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx)
+#endif
+
+static void IRAM_ATTR dc_motor_on_overflow(int32_t value, void *user_ctx)
 {
     dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)user_ctx;
-    dc_motor_context->accumu_count += edata->watch_point_value;
-    return false;
+    dc_motor_context->accumu_count += value;
+}
+
+// ends a goto once the position reached its target, in the control ISR or the counter ISR
+static bool IRAM_ATTR dc_motor_reached_target(dc_motor_context_t *dc_motor_context, int32_t position)
+{
+    if (!dc_motor_context->running || !dc_motor_context->run.stop_at_target) return false;
+    int32_t to_go = dc_motor_context->run.target - position;
+    if (dc_motor_context->run.direction) to_go = -to_go;
+    if (to_go > 0) return false;
+
+    dc_motor_context->running = false;
+    dc_motor_context->pid_output = 0;
+    return true;
 }
  
 
-static bool pwm_callback(mcpwm_cmpr_handle_t comp2, const mcpwm_compare_event_data_t *edata, void *user_ctx)
+// position within the current count, Q16 in the counter direction, from the
+// speed between the last encoder edges and the time since the last one
+static int32_t IRAM_ATTR dc_motor_position_fraction(dc_motor_context_t *dc_motor_context, const dc_motor_hal_edge_t *edge, int32_t pulse_new)
+{
+    int32_t edges = edge->edges - dc_motor_context->last_edge.edges;
+    int64_t speed = dc_motor_context->edge_speed;
+    int64_t elapsed = dc_motor_hal_get_time() - edge->time;
+
+    if (edges != 0) {
+        int64_t dt = edge->time - dc_motor_context->last_edge.time;
+        if (dt > 0) speed = ((int64_t)abs(edges) * CONTROL_PERIOD_US << 16) / dt;
+    }
+    else if (elapsed > 0) {
+        // no edge in this period, the speed is at most one count since the last one
+        int64_t bound = ((int64_t)CONTROL_PERIOD_US << 16) / elapsed;
+        if (speed > bound) speed = bound;
+    }
+    dc_motor_context->last_edge = *edge;
+    dc_motor_context->edge_speed = speed;
+
+    // an edge between reading the counter and the edge time, or too fast to interpolate
+    int32_t n = abs(pulse_new);
+    if ((edges != pulse_new) || (n >= DC_MOTOR_SPEED_EDGE_HIGH)) return 0;
+
+    int64_t fraction = speed * elapsed / CONTROL_PERIOD_US;
+    if (fraction > 0xFFFF) fraction = 0xFFFF;
+    if (n > DC_MOTOR_SPEED_EDGE_LOW) {
+        fraction = fraction * (DC_MOTOR_SPEED_EDGE_HIGH - n) / (DC_MOTOR_SPEED_EDGE_HIGH - DC_MOTOR_SPEED_EDGE_LOW);
+    }
+    // the counter changed to its current value at the last edge, going down that is the top of the count
+    return (edge->direction > 0) ? fraction : (1 << 16) - fraction;
+}
+
+// the run starts from the learned duty and the PID output follows it when the
+// setpoint changes; without a learned point the output is left alone
+static void IRAM_ATTR dc_motor_feedforward(dc_motor_context_t *dc_motor_context, pid_value_t speed)
+{
+    pid_gain_t duty;
+    if (!duty_map_lookup(&dc_motor_context->duty_map, dc_motor_context->run.direction, speed, &duty)) return;
+    add_output(dc_motor_context, dc_motor_context->ff_valid ? duty - dc_motor_context->ff_duty : duty - dc_motor_context->pid_output);
+    dc_motor_context->ff_duty = duty;
+    dc_motor_context->ff_valid = true;
+}
+
+// counts the periods with a steady setpoint and a small position error
+static void IRAM_ATTR dc_motor_settle(dc_motor_context_t *dc_motor_context, pid_value_t speed)
+{
+    pid_value_t change = speed - dc_motor_context->run_speed;
+    if (change < 0) change = -change;
+    pid_value_t error = dc_motor_context->idif;
+    if (error < 0) error = -error;
+    dc_motor_context->run_speed = speed;
+
+    if ((change <= speed / 64) && (error <= PID_VALUE(DC_MOTOR_SETTLE_ERROR)) &&
+        (dc_motor_context->autotune.state != AUTOTUNE_RUNNING)) {
+        if (dc_motor_context->settle_periods < INT32_MAX) dc_motor_context->settle_periods++;
+    }
+    else {
+        dc_motor_context->settle_periods = 0;
+    }
+}
+
+static void IRAM_ATTR dc_motor_use_gains(dc_motor_context_t *dc_motor_context)
+{
+    const dc_motor_gains_t *gains = &dc_motor_context->gains[dc_motor_context->regime];
+    dc_motor_context->Kp = gains->Kp;
+    dc_motor_context->Ki = gains->Ki;
+    dc_motor_context->Kd = gains->Kd;
+}
+
+// picks the gains for the setpoint of this period; the PID only adds increments
+// to its output, so new gains take over from the current duty without a bump
+static void IRAM_ATTR dc_motor_schedule(dc_motor_context_t *dc_motor_context, pid_value_t speed, bool guided)
+{
+    if (guided) dc_motor_context->guide_periods = DC_MOTOR_GUIDE_HOLD_MS * CONTROL_RATE_HZ / 1000;
+    else if (dc_motor_context->guide_periods > 0) dc_motor_context->guide_periods--;
+
+    // with some hysteresis, a rate close to the limit does not switch every period
+    pid_value_t slew = (dc_motor_context->regime == DC_MOTOR_REGIME_SLEW) ?
+        PID_VALUE((double)DC_MOTOR_SLEW_EXIT_SPEED / CONTROL_RATE_HZ) : PID_VALUE((double)DC_MOTOR_SLEW_SPEED / CONTROL_RATE_HZ);
+    if (speed < 0) speed = -speed;
+
+    dc_motor_regime_t regime;
+    if (dc_motor_context->run.stop_at_target || (speed > slew)) regime = DC_MOTOR_REGIME_SLEW;
+    else if (dc_motor_context->guide_periods > 0) regime = DC_MOTOR_REGIME_GUIDING;
+    else regime = DC_MOTOR_REGIME_TRACKING;
+
+    if (regime != dc_motor_context->regime) {
+        dc_motor_context->regime = regime;
+        dc_motor_use_gains(dc_motor_context);
+    }
+}
+
+static void IRAM_ATTR dc_motor_apply_mailbox(dc_motor_context_t *dc_motor_context)
+{
+    uint32_t tail = dc_motor_context->mailbox_tail;
+    uint32_t head = __atomic_load_n(&dc_motor_context->mailbox_head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        dc_motor_cmd_t *cmd = &dc_motor_context->mailbox[tail % DC_MOTOR_MAILBOX_SIZE];
+        switch (cmd->type) {
+            case DC_MOTOR_CMD_START:
+                dc_motor_context->run = dc_motor_context->next_run;
+                if (dc_motor_context->run.takeup) {
+                    // the position and the worm stay where they are while the play is taken up
+                    int32_t takeup = dc_motor_context->run.direction ? -(int32_t)dc_motor_context->run.takeup : (int32_t)dc_motor_context->run.takeup;
+                    dc_motor_context->accumu_count -= takeup;
+                    dc_motor_context->pulse_count -= takeup;
+                    dc_motor_context->worm_phase -= takeup;
+                    if (dc_motor_context->worm_phase >= DC_WORM_PERIOD) dc_motor_context->worm_phase -= DC_WORM_PERIOD;
+                    if (dc_motor_context->worm_phase < 0) dc_motor_context->worm_phase += DC_WORM_PERIOD;
+                }
+                dc_motor_context->idif = 0;
+                dc_motor_context->prev_error = 0;
+                dc_motor_context->prev_error2 = 0;
+                dc_motor_context->ff_valid = false;
+                dc_motor_context->settle_periods = 0;
+                dc_motor_context->running = true;
+                dc_motor_context->guide_periods = 0;
+                dc_motor_context->regime = dc_motor_context->run.stop_at_target ? DC_MOTOR_REGIME_SLEW : DC_MOTOR_REGIME_TRACKING;
+                dc_motor_use_gains(dc_motor_context);
+                autotune_abort(&dc_motor_context->autotune);
+                break;
+            case DC_MOTOR_CMD_STOP:
+                dc_motor_context->running = false;
+                autotune_abort(&dc_motor_context->autotune);
+                break;
+            case DC_MOTOR_CMD_SET_POSITION:
+                dc_motor_context->accumu_count += cmd->position - dc_motor_context->pulse_count;
+                dc_motor_context->pulse_count = cmd->position;
+                dc_motor_context->idif = 0;
+                break;
+            case DC_MOTOR_CMD_SET_RATE:
+                dc_motor_context->rate = cmd->rate;
+                break;
+            case DC_MOTOR_CMD_SET_GAINS:
+                dc_motor_context->gains[cmd->regime] = cmd->gains;
+                dc_motor_use_gains(dc_motor_context);
+                break;
+            case DC_MOTOR_CMD_AUTOTUNE:
+                if (dc_motor_context->running && !dc_motor_context->run.stop_at_target) {
+                    autotune_begin(&dc_motor_context->autotune, dc_motor_context->pid_output, cmd->amplitude);
+                }
+                else {
+                    __atomic_store_n(&dc_motor_context->autotune.state, AUTOTUNE_FAILED, __ATOMIC_RELEASE);
+                }
+                break;
+        }
+        tail++;
+    }
+    __atomic_store_n(&dc_motor_context->mailbox_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void IRAM_ATTR dc_motor_publish(dc_motor_context_t *dc_motor_context, int32_t pulse_new)
+{
+    uint32_t seq = dc_motor_context->snapshot_seq;
+    __atomic_store_n(&dc_motor_context->snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    dc_motor_context->snapshot.position = dc_motor_context->pulse_count;
+    dc_motor_context->snapshot.speed = pulse_new;
+    dc_motor_context->snapshot.target_speed = PID_VALUE_FROM_Q16(dc_motor_context->rate.step);
+    dc_motor_context->snapshot.idif = dc_motor_context->idif;
+    dc_motor_context->snapshot.comp_value = dc_motor_context->comp_value;
+    dc_motor_context->snapshot.running = dc_motor_context->running;
+    dc_motor_context->snapshot.direction = dc_motor_context->run.direction;
+    dc_motor_context->snapshot.stop_at_target = dc_motor_context->run.stop_at_target;
+    dc_motor_context->snapshot.target = dc_motor_context->run.target;
+    dc_motor_context->snapshot.run_speed = dc_motor_context->run_speed;
+    dc_motor_context->snapshot.pid_output = dc_motor_context->pid_output;
+    dc_motor_context->snapshot.settled = dc_motor_context->running &&
+        (dc_motor_context->settle_periods >= DC_MOTOR_SETTLE_MS * CONTROL_RATE_HZ / 1000);
+    dc_motor_context->snapshot.regime = dc_motor_context->regime;
+
+    __atomic_store_n(&dc_motor_context->snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// the counter reached the watch point armed by dc_motor_supervise, the goto
+// stops on that count instead of up to a control period later; at the level
+// of the control step, which it cannot interrupt
+static void IRAM_ATTR dc_motor_on_watch(void *user_ctx)
+{
+    dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)user_ctx;
+    int32_t position = dc_motor_context->accumu_count + dc_motor_hal_get_count(&dc_motor_context->hal);
+    // a watch point left from before an overflow
+    if (!dc_motor_reached_target(dc_motor_context, position)) return;
+
+    dc_motor_context->comp_value = 0;
+    dc_motor_hal_set_compare(&dc_motor_context->hal, 0);
+    // :f sees the stop right away, the position follows with the next period
+    dc_motor_publish(dc_motor_context, dc_motor_context->snapshot.speed);
+}
+
+static bool IRAM_ATTR dc_motor_on_control(void *user_ctx)
 {
-    BaseType_t high_task_wakeup = pdFALSE;
     dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)user_ctx;
     
-    int pulse_count_hw;
-    ESP_ERROR_CHECK(pcnt_unit_get_count(dc_motor_context->pcnt_unit, &pulse_count_hw));
-    int32_t pulse_count_new = dc_motor_context->accumu_count + pulse_count_hw;
+    int32_t pulse_count_new = dc_motor_context->accumu_count + dc_motor_hal_get_count(&dc_motor_context->hal);
     int32_t pulse_new = pulse_count_new - dc_motor_context->pulse_count;
-    if (dc_motor_context->direction) pulse_new = -pulse_new;
     dc_motor_context->pulse_count = pulse_count_new;
 
-    dc_motor_context->dif = dc_motor_context->target_speed - pulse_new;
-    dc_motor_context->idif += dc_motor_context->dif;
+    dc_motor_hal_edge_t edge;
+    dc_motor_hal_get_edge(&dc_motor_context->hal, &edge);
+    int32_t fraction = dc_motor_position_fraction(dc_motor_context, &edge, pulse_new);
+    // movement in this period with sub-count resolution, Q16
+    int64_t moved = (int64_t)pulse_new * (1 << 16) + fraction - dc_motor_context->fraction;
+    dc_motor_context->fraction = fraction;
 
-    dc_motor_context->comp_value = pid(dc_motor_context, dc_motor_context->idif);
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(dc_motor_context->comparator, dc_motor_context->comp_value));
+    dc_motor_context->worm_phase += pulse_new;
+    if (dc_motor_context->worm_phase >= DC_WORM_PERIOD) dc_motor_context->worm_phase -= DC_WORM_PERIOD;
+    if (dc_motor_context->worm_phase < 0) dc_motor_context->worm_phase += DC_WORM_PERIOD;
+
+    // taken every period, it only applies while tracking
+    int32_t guide = guide_take(&dc_motor_context->guide, dc_motor_hal_get_time());
+
+    dc_motor_apply_mailbox(dc_motor_context);
+    if (dc_motor_context->run.direction) {
+        pulse_new = -pulse_new;
+        moved = -moved;
+    }
+
+    // normally the counter ISR was first, see dc_motor_on_watch
+    dc_motor_reached_target(dc_motor_context, dc_motor_context->pulse_count);
+
+    if (dc_motor_context->running) {
+        pid_value_t speed;
+        if (dc_motor_context->run.stop_at_target) {
+            speed = motion_profile_next(&dc_motor_context->run.profile);
+        }
+        else {
+            speed = PID_VALUE_FROM_Q16(rate_next(&dc_motor_context->rate));
+            // the PEC table, the guide offset and the recording are in the counter direction
+            pid_value_t offset = pec_feedforward(&dc_motor_context->pec, dc_motor_context->worm_phase) + PID_VALUE_FROM_Q16(guide);
+            speed += dc_motor_context->run.direction ? -offset : offset;
+            pec_record(&dc_motor_context->pec, dc_motor_context->worm_phase, pulse_new,
+                       dc_motor_context->run.direction ? -speed : speed);
+        }
+        speed += motion_profile_next(&dc_motor_context->run.takeup_profile);
+        dc_motor_schedule(dc_motor_context, speed, !dc_motor_context->run.stop_at_target && guide);
+        if ((dc_motor_context->autotune.state != AUTOTUNE_RUNNING) && !dc_motor_context->run.measure) dc_motor_feedforward(dc_motor_context, speed);
+
+#if DC_MOTOR_FIXED_PID
+        dc_motor_context->dif = speed - PID_VALUE_FROM_Q16(moved);
+        int32_t idif = dc_motor_context->idif + dc_motor_context->dif;
+        // the error is a position, a stalled motor must not wrap it
+        if (idif > PID_VALUE_MAX) idif = PID_VALUE_MAX;
+        if (idif < -PID_VALUE_MAX) idif = -PID_VALUE_MAX;
+        dc_motor_context->idif = idif;
+#else
+        dc_motor_context->dif = speed - PID_VALUE_FROM_Q16(moved);
+        dc_motor_context->idif += dc_motor_context->dif;
+#endif
+
+        if (dc_motor_context->autotune.state == AUTOTUNE_RUNNING) {
+            pid_gain_t output = autotune_step(&dc_motor_context->autotune, dc_motor_context->idif);
+            // the PID continues from the relay bias without a derivative kick
+            if (dc_motor_context->autotune.state != AUTOTUNE_RUNNING) output = dc_motor_context->autotune.bias;
+            dc_motor_context->pid_output = output;
+            dc_motor_context->prev_error2 = dc_motor_context->prev_error;
+            dc_motor_context->prev_error = dc_motor_context->idif;
+            dc_motor_context->comp_value = output_to_compare(output);
+        }
+        else {
+            dc_motor_context->comp_value = pid(dc_motor_context, dc_motor_context->idif);
+        }
+        dc_motor_settle(dc_motor_context, speed);
+    }
+    else {
+        // stopped or goto finished, coast
+        dc_motor_context->comp_value = 0;
+    }
+    dc_motor_hal_set_compare(&dc_motor_context->hal, dc_motor_context->comp_value);
 
-    xTaskNotifyFromISR(task_to_notify, 0, eSetValueWithOverwrite, &high_task_wakeup);
+    dc_motor_publish(dc_motor_context, pulse_new);
 
-    return high_task_wakeup;
+    telemetry_record_t record = {
+        .time = dc_motor_hal_get_time(),
+        .delta = pulse_new,
+        .comp_value = dc_motor_context->comp_value,
+        .error = PID_VALUE_TO_Q16(dc_motor_context->dif),
+        .integral = PID_VALUE_TO_Q16(dc_motor_context->idif),
+    };
+    telemetry_push(&record);
+
+    return false;
 }
 
+static void dc_motor_post(dc_motor_context_t *dc_motor_context, const dc_motor_cmd_t *cmd)
+{
+    xSemaphoreTake(dc_motor_context->post_lock, portMAX_DELAY);
+    uint32_t head = dc_motor_context->mailbox_head;
+    while (head - __atomic_load_n(&dc_motor_context->mailbox_tail, __ATOMIC_ACQUIRE) >= DC_MOTOR_MAILBOX_SIZE) {
+        vTaskDelay(1);
+    }
+    dc_motor_context->mailbox[head % DC_MOTOR_MAILBOX_SIZE] = *cmd;
+    __atomic_store_n(&dc_motor_context->mailbox_head, head + 1, __ATOMIC_RELEASE);
+    xSemaphoreGive(dc_motor_context->post_lock);
+}
 
-void dc_motor_init(dc_motor_context_t *dc_motor_context)
+// wait until the control ISR took all posted commands, at most one period
+static void dc_motor_sync(dc_motor_context_t *dc_motor_context)
 {
-    pcnt_unit_config_t unit_config = {
-        .high_limit = 30000,
-        .low_limit = -30000,
-    };
-    ESP_ERROR_CHECK(pcnt_new_unit(&unit_config, &dc_motor_context->pcnt_unit));
+    while (__atomic_load_n(&dc_motor_context->mailbox_tail, __ATOMIC_ACQUIRE) != dc_motor_context->mailbox_head) {
+        vTaskDelay(1);
+    }
+}
 
-    pcnt_glitch_filter_config_t filter_config = {
-        .max_glitch_ns = 2000,
-    };
-    ESP_ERROR_CHECK(pcnt_unit_set_glitch_filter(dc_motor_context->pcnt_unit, &filter_config));
+// stop without touching NVS, also from the control task
+static void dc_motor_halt(dc_motor_context_t *dc_motor_context)
+{
+    dc_motor_hal_set_drive(&dc_motor_context->hal, DC_MOTOR_DRIVE_OFF);
 
-    pcnt_chan_config_t chan_a_config = {
-        .edge_gpio_num = ENC1_GPIO,
-        .level_gpio_num = ENC2_GPIO,
-    };
-    pcnt_channel_handle_t pcnt_chan_a = NULL;
-    ESP_ERROR_CHECK(pcnt_new_channel(dc_motor_context->pcnt_unit, &chan_a_config, &pcnt_chan_a));
-    pcnt_chan_config_t chan_b_config = {
-        .edge_gpio_num = ENC2_GPIO,
-        .level_gpio_num = ENC1_GPIO,
-    };
-    pcnt_channel_handle_t pcnt_chan_b = NULL;
-    ESP_ERROR_CHECK(pcnt_new_channel(dc_motor_context->pcnt_unit, &chan_b_config, &pcnt_chan_b));
-
-    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan_a, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
-    ESP_ERROR_CHECK(pcnt_channel_set_level_action(pcnt_chan_a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE));
-    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan_b, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE));
-    ESP_ERROR_CHECK(pcnt_channel_set_level_action(pcnt_chan_b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE));
-
-    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(dc_motor_context->pcnt_unit, 30000));
-    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(dc_motor_context->pcnt_unit, -30000));
-    pcnt_event_callbacks_t pcnt_cbs = {
-        .on_reach = pcnt_on_reach, // accumulate the overflow in the callback
-    };
-    ESP_ERROR_CHECK(pcnt_unit_register_event_callbacks(dc_motor_context->pcnt_unit, &pcnt_cbs, dc_motor_context));
+    dc_motor_cmd_t cmd = { .type = DC_MOTOR_CMD_STOP };
+    dc_motor_post(dc_motor_context, &cmd);
+}
+
+// control task, learns the duty map from settled runs and stops a motor held
+// at full duty without moving
+static void dc_motor_supervise(void *user_ctx)
+{
+    dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)user_ctx;
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+
+    // the goto target as a PCNT watch point once it is within the counter range
+    int32_t watch = DC_MOTOR_HAL_NO_WATCH;
+    if (snapshot.running && snapshot.stop_at_target) {
+        int32_t value = snapshot.target - __atomic_load_n(&dc_motor_context->accumu_count, __ATOMIC_RELAXED);
+        if ((value != 0) && (abs(value) < DC_MOTOR_HAL_COUNT_LIMIT)) watch = value;
+    }
+    if (watch != dc_motor_context->hal.watch) dc_motor_hal_set_watch(&dc_motor_context->hal, watch);
+
+    bool saturated = snapshot.running && (snapshot.comp_value >= PWM_PERIOD);
+    bool measuring = dc_motor_get_backlash_state(dc_motor_context) == BACKLASH_MEASURING;
+    if (snapshot.settled && !saturated && !measuring) {
+        duty_map_learn(&dc_motor_context->duty_map, snapshot.direction, snapshot.run_speed, snapshot.pid_output);
+    }
+
+    if (!saturated || (snapshot.position != dc_motor_context->stall_position)) {
+        dc_motor_context->stall_position = snapshot.position;
+        dc_motor_context->stall_periods = 0;
+        return;
+    }
+    if (++dc_motor_context->stall_periods == DC_MOTOR_STALL_MS * CONTROL_RATE_HZ / 1000) {
+        dc_motor_halt(dc_motor_context);
+    }
+}
 
+static void dc_motor_gains(const dc_motor_tuning_t *tuning, dc_motor_gains_t *gains)
+{
+    gains->Kp = DC_MOTOR_KP(tuning->kp);
+    gains->Ki = DC_MOTOR_KI(tuning->ki);
+    gains->Kd = DC_MOTOR_KD(tuning->kd);
+}
 
-    ESP_ERROR_CHECK(pcnt_unit_enable(dc_motor_context->pcnt_unit));
-    ESP_ERROR_CHECK(pcnt_unit_clear_count(dc_motor_context->pcnt_unit));
-    ESP_ERROR_CHECK(pcnt_unit_start(dc_motor_context->pcnt_unit));
+#define DC_MOTOR_NVS_NAMESPACE "motor"
 
+static void dc_motor_load_tuning(dc_motor_context_t *dc_motor_context)
+{
+    dc_motor_tuning_t tuning[DC_MOTOR_REGIMES];
+    size_t len = sizeof(tuning);
+
+    nvs_handle_t handle;
+    if (nvs_open(DC_MOTOR_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return;
+    esp_err_t err = nvs_get_blob(handle, "tuning", tuning, &len);
+    nvs_close(handle);
+    if (err != ESP_OK) return;
+    // stored before the guiding regime, which starts from the tracking gains
+    if (len == DC_MOTOR_REGIME_GUIDING * sizeof(dc_motor_tuning_t)) {
+        tuning[DC_MOTOR_REGIME_GUIDING] = tuning[DC_MOTOR_REGIME_TRACKING];
+        len = sizeof(tuning);
+    }
+    if (len == sizeof(tuning)) memcpy(dc_motor_context->tuning, tuning, sizeof(tuning));
+}
 
+void dc_motor_save_tuning(dc_motor_context_t *dc_motor_context)
+{
+    nvs_handle_t handle;
+    if (nvs_open(DC_MOTOR_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_set_blob(handle, "tuning", dc_motor_context->tuning, sizeof(dc_motor_context->tuning));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
 
-    mcpwm_timer_config_t timer_config = {
-        .group_id = 0,
-        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
-        .resolution_hz = PWM_RESOLUTION_HZ,
-        .period_ticks = PWM_PERIOD,
-        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
-    };
-    ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &dc_motor_context->timer));
+void dc_motor_set_tuning(dc_motor_context_t *dc_motor_context, dc_motor_regime_t regime, const dc_motor_tuning_t *tuning)
+{
+    dc_motor_context->tuning[regime] = *tuning;
 
-    mcpwm_oper_handle_t oper = NULL;
-    mcpwm_operator_config_t operator_config = {
-        .group_id = 0, // operator must be in the same group to the timer
+    dc_motor_cmd_t cmd = {
+        .type = DC_MOTOR_CMD_SET_GAINS,
+        .regime = regime,
     };
-    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &oper));
+    dc_motor_gains(tuning, &cmd.gains);
+    dc_motor_post(dc_motor_context, &cmd);
+}
 
-    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(oper, dc_motor_context->timer));
+static void dc_motor_autotune_task(void *pvParameters)
+{
+    dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)pvParameters;
+    autotune_t *autotune = &dc_motor_context->autotune;
 
-    mcpwm_comparator_config_t comparator_config = {
-        .flags.update_cmp_on_tez = true,
-    };
-    ESP_ERROR_CHECK(mcpwm_new_comparator(oper, &comparator_config, &dc_motor_context->comparator));
+    autotune_state_t state;
+    while (((state = dc_motor_get_autotune_state(dc_motor_context)) == AUTOTUNE_STARTING) || (state == AUTOTUNE_RUNNING)) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+
+    if (state == AUTOTUNE_DONE) {
+        double ku, tu;
+        autotune_result(autotune, &ku, &tu);
+
+        // Tyreus-Luyben for tracking, robust with the integrating plant,
+        // classic Ziegler-Nichols for slews to follow the profile closely and
+        // the "some overshoot" rule for guiding, between the two
+        dc_motor_tuning_t tracking = { .kp = 0.31 * ku, .ki = 0.31 * ku / (2.2 * tu), .kd = 0.31 * ku * tu / 6.3 };
+        dc_motor_tuning_t slew = { .kp = 0.6 * ku, .ki = 0.6 * ku / (tu / 2), .kd = 0.6 * ku * tu / 8 };
+        dc_motor_tuning_t guiding = { .kp = 0.33 * ku, .ki = 0.33 * ku / (tu / 2), .kd = 0.33 * ku * tu / 3 };
+        sw_command_lock();
+        dc_motor_set_tuning(dc_motor_context, DC_MOTOR_REGIME_TRACKING, &tracking);
+        dc_motor_set_tuning(dc_motor_context, DC_MOTOR_REGIME_SLEW, &slew);
+        dc_motor_set_tuning(dc_motor_context, DC_MOTOR_REGIME_GUIDING, &guiding);
+        dc_motor_save_tuning(dc_motor_context);
+        sw_command_unlock();
+    }
+    vTaskDelete(NULL);
+}
+
+bool dc_motor_autotune(dc_motor_context_t *dc_motor_context, double amplitude)
+{
+    autotune_state_t state = dc_motor_get_autotune_state(dc_motor_context);
+    if ((state == AUTOTUNE_STARTING) || (state == AUTOTUNE_RUNNING)) return false;
+
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    if (!snapshot.running || dc_motor_context->next_run.stop_at_target) return false;
 
-    mcpwm_generator_config_t generator_config = {
-        .gen_gpio_num = MOTOR1_GPIO,
-        .flags.invert_pwm = true,
+    __atomic_store_n(&dc_motor_context->autotune.state, AUTOTUNE_STARTING, __ATOMIC_RELEASE);
+    dc_motor_cmd_t cmd = {
+        .type = DC_MOTOR_CMD_AUTOTUNE,
+        .amplitude = PID_GAIN(amplitude),
     };
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper, &generator_config, &dc_motor_context->generator1));
+    dc_motor_post(dc_motor_context, &cmd);
+    xTaskCreatePinnedToCore(dc_motor_autotune_task, "autotune", 4096, dc_motor_context, 2, NULL, COMMS_CORE);
+    return true;
+}
 
+autotune_state_t dc_motor_get_autotune_state(dc_motor_context_t *dc_motor_context)
+{
+    return __atomic_load_n(&dc_motor_context->autotune.state, __ATOMIC_ACQUIRE);
+}
 
-    // go high on counter empty
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator1,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
-    // go low on compare threshold
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(dc_motor_context->generator1,
-                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, dc_motor_context->comparator, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+// a goto at the current slew speed, sampling the travel and the PID output;
+// -1 if it was stopped short of the target, by :K or a stall
+static int dc_motor_backlash_move(dc_motor_context_t *dc_motor_context, int32_t target, int32_t *travel, pid_gain_t *output, int size)
+{
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    int32_t start = snapshot.position;
+
+    sw_command_lock();
+    dc_motor_set_target(dc_motor_context, target);
+    dc_motor_set_stop_at_target(dc_motor_context, true);
+    dc_motor_start(dc_motor_context);
+    bool reverse = dc_motor_context->direction;
+    sw_command_unlock();
+
+    // the run shows in the snapshot from the next control period on
+    int count = 0;
+    do {
+        if (count < size) {
+            travel[count] = abs(snapshot.position - start);
+            output[count] = snapshot.pid_output;
+            count++;
+        }
+        vTaskDelay(pdMS_TO_TICKS(BACKLASH_SAMPLE_MS));
+        dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    } while (snapshot.running);
+    int32_t to_go = target - snapshot.position;
+    return ((reverse ? -to_go : to_go) > 0) ? -1 : count;
+}
 
+static void dc_motor_backlash_task(void *pvParameters)
+{
+    dc_motor_context_t *dc_motor_context = (dc_motor_context_t *)pvParameters;
+    backlash_t *backlash = &dc_motor_context->backlash;
+
+    // the command handlers refuse motion commands until it is done, what
+    // they set before is restored at the end
+    sw_command_lock();
+    double slew_speed = dc_motor_context->slew_speed;
+    uint32_t counts = backlash->counts;
+    int32_t target = dc_motor_context->target;
+    bool stop_at_target = dc_motor_context->stop_at_target;
+    bool direction = dc_motor_context->direction;
+    dc_motor_context->slew_speed = BACKLASH_SPEED;
+    backlash->counts = 0;
+    sw_command_unlock();
+
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    int32_t start = snapshot.position;
+
+    // engage the gear forward, then reverse through the play into the load
+    static int32_t travel[BACKLASH_SAMPLES];
+    static pid_gain_t output[BACKLASH_SAMPLES];
+    int32_t measured = -1;
+    if (dc_motor_backlash_move(dc_motor_context, start + BACKLASH_MAX, NULL, NULL, 0) >= 0) {
+        int count = dc_motor_backlash_move(dc_motor_context, start - BACKLASH_ENGAGED, travel, output, BACKLASH_SAMPLES);
+        if (count >= 0) measured = backlash_estimate(travel, output, count);
+    }
 
-    generator_config.gen_gpio_num = MOTOR2_GPIO;
+    // back to the start, taking up what was found; not after a stop
+    sw_command_lock();
+    dc_motor_context->slew_speed = slew_speed;
+    if (measured >= 0) backlash_set(backlash, measured);
+    else backlash->counts = counts;
+    sw_command_unlock();
+    if (measured >= 0) dc_motor_backlash_move(dc_motor_context, start, NULL, NULL, 0);
 
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper, &generator_config, &dc_motor_context->generator2));
-    // go high on counter empty
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator2,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
-    // go low on compare threshold
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(dc_motor_context->generator2,
-                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, dc_motor_context->comparator, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+    sw_command_lock();
+    dc_motor_context->target = target;
+    dc_motor_context->stop_at_target = stop_at_target;
+    dc_motor_context->direction = direction;
+    __atomic_store_n(&backlash->state, (measured >= 0) ? BACKLASH_DONE : BACKLASH_FAILED, __ATOMIC_RELEASE);
+    sw_command_unlock();
+    vTaskDelete(NULL);
+}
 
+void dc_motor_set_backlash(dc_motor_context_t *dc_motor_context, uint32_t counts)
+{
+    backlash_set(&dc_motor_context->backlash, counts);
+}
 
-    mcpwm_cmpr_handle_t comparator2 = NULL;
-    ESP_ERROR_CHECK(mcpwm_new_comparator(oper, &comparator_config, &comparator2));
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator2, PWM_CB_AT));
-    
-    mcpwm_comparator_event_callbacks_t comparator_callbacks = {
-        .on_reach = pwm_callback,
-    };
-    ESP_ERROR_CHECK(mcpwm_comparator_register_event_callbacks(comparator2, &comparator_callbacks, dc_motor_context));
+bool dc_motor_measure_backlash(dc_motor_context_t *dc_motor_context)
+{
+    if (dc_motor_get_backlash_state(dc_motor_context) == BACKLASH_MEASURING) return false;
 
-/*
-    esp_rom_gpio_pad_select_gpio(MOTOR2_GPIO);
-    gpio_set_direction(MOTOR2_GPIO, GPIO_MODE_OUTPUT);
-    gpio_set_level(MOTOR2_GPIO, 1);
-*/
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    if (snapshot.running) return false;
 
-    ESP_ERROR_CHECK(mcpwm_timer_enable(dc_motor_context->timer));
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(dc_motor_context->comparator, 0));
+    __atomic_store_n(&dc_motor_context->backlash.state, BACKLASH_MEASURING, __ATOMIC_RELEASE);
+    xTaskCreatePinnedToCore(dc_motor_backlash_task, "backlash", 4096, dc_motor_context, 2, NULL, COMMS_CORE);
+    return true;
+}
 
+backlash_state_t dc_motor_get_backlash_state(dc_motor_context_t *dc_motor_context)
+{
+    return __atomic_load_n(&dc_motor_context->backlash.state, __ATOMIC_ACQUIRE);
 }
 
-void dc_motor_start(dc_motor_context_t *dc_motor_context)
+void dc_motor_init(dc_motor_context_t *dc_motor_context)
 {
-    dc_motor_context->idif = 0;
+    dc_motor_context->post_lock = xSemaphoreCreateMutex();
 
-    if (dc_motor_context->direction) {
-        ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator1,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
-        ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator2,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+    dc_motor_load_tuning(dc_motor_context);
+    backlash_init(&dc_motor_context->backlash);
+    for (int i = 0; i < DC_MOTOR_REGIMES; i++) {
+        dc_motor_gains(&dc_motor_context->tuning[i], &dc_motor_context->gains[i]);
     }
-    else {
-        ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator1,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
-        ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator2,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+    dc_motor_use_gains(dc_motor_context);
+
+    dc_motor_hal_callbacks_t cbs = {
+        .on_control = dc_motor_on_control,
+        .on_overflow = dc_motor_on_overflow, // accumulate the overflow in the callback
+        .on_watch = dc_motor_on_watch,
+    };
+    rate_set(&dc_motor_context->rate, dc_motor_context->rate_counts, dc_motor_context->rate_interval_us);
+    pec_init(&dc_motor_context->pec, DC_WORM_PERIOD);
+    duty_map_init(&dc_motor_context->duty_map);
+    guide_init(&dc_motor_context->guide);
+    dc_motor_hal_init(&dc_motor_context->hal, &cbs, dc_motor_context);
+    scheduler_add_task(dc_motor_supervise, dc_motor_context);
+    // the control ISR runs all the time to keep the position and the snapshot current
+    dc_motor_hal_start(&dc_motor_context->hal);
+}
+
+void dc_motor_start(dc_motor_context_t *dc_motor_context)
+{
+    dc_motor_snapshot_t snapshot;
+    // also makes sure the ISR is done with next_run
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+
+    dc_motor_run_t *run = &dc_motor_context->next_run;
+    run->stop_at_target = dc_motor_context->stop_at_target;
+    run->target = dc_motor_context->target;
+    if (run->stop_at_target) {
+        int32_t distance = run->target - snapshot.position;
+        dc_motor_context->direction = distance < 0;
+        motion_profile_plan(&run->profile, abs(distance),
+                            dc_motor_context->slew_speed / CONTROL_RATE_HZ,
+                            dc_motor_context->slew_accel / ((double)CONTROL_RATE_HZ * CONTROL_RATE_HZ));
+    }
+    bool reversing = snapshot.running && (run->direction != dc_motor_context->direction);
+    run->direction = dc_motor_context->direction;
+    run->takeup = backlash_takeup(&dc_motor_context->backlash, run->direction);
+    // the learned duty would spin the motor through the play before the PID settles
+    run->measure = dc_motor_get_backlash_state(dc_motor_context) == BACKLASH_MEASURING;
+    motion_profile_plan(&run->takeup_profile, run->takeup,
+                        dc_motor_context->slew_speed / CONTROL_RATE_HZ,
+                        dc_motor_context->slew_accel / ((double)CONTROL_RATE_HZ * CONTROL_RATE_HZ));
+
+    // the ISR keeps driving the previous run until it takes START, switching
+    // the H-bridge under its duty would push the other way at full speed;
+    // stop it first, the snapshot is published after the compare went to 0
+    if (reversing) {
+        dc_motor_halt(dc_motor_context);
+        do {
+            vTaskDelay(1);
+            dc_motor_get_snapshot(dc_motor_context, &snapshot);
+        } while (snapshot.running);
     }
+    dc_motor_hal_set_drive(&dc_motor_context->hal, run->direction ? DC_MOTOR_DRIVE_REVERSE : DC_MOTOR_DRIVE_FORWARD);
 
-    ESP_ERROR_CHECK(mcpwm_timer_start_stop(dc_motor_context->timer, MCPWM_TIMER_START_NO_STOP));
-    dc_motor_context->running = true;
+    dc_motor_cmd_t cmd = { .type = DC_MOTOR_CMD_START };
+    dc_motor_post(dc_motor_context, &cmd);
+    duty_map_save(&dc_motor_context->duty_map);
 }
 
 void dc_motor_stop(dc_motor_context_t *dc_motor_context)
 {
-    ESP_ERROR_CHECK(mcpwm_timer_start_stop(dc_motor_context->timer, MCPWM_TIMER_STOP_FULL));
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator1,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(dc_motor_context->generator2,
-                    MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_LOW),
-                    MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+    dc_motor_halt(dc_motor_context);
+    duty_map_save(&dc_motor_context->duty_map);
+}
 
-    dc_motor_context->running = false;
+void dc_motor_suspend(dc_motor_context_t *dc_motor_context, bool suspend)
+{
+    dc_motor_hal_suspend(&dc_motor_context->hal, suspend);
 }
 
 void dc_motor_set_direction(dc_motor_context_t *dc_motor_context, bool direction)
@@ -257,15 +751,21 @@ void dc_motor_set_init(dc_motor_context_t *dc_motor_context, bool init)
 
 void dc_motor_set_position(dc_motor_context_t *dc_motor_context, int32_t position)
 {
-    ESP_ERROR_CHECK(pcnt_unit_clear_count(dc_motor_context->pcnt_unit));
-    dc_motor_context->accumu_count = position;
-    dc_motor_context->pulse_count = position;
-    dc_motor_context->idif = 0;
+    dc_motor_cmd_t cmd = {
+        .type = DC_MOTOR_CMD_SET_POSITION,
+        .position = position,
+    };
+    dc_motor_post(dc_motor_context, &cmd);
 }
 
-void dc_motor_set_speed(dc_motor_context_t *dc_motor_context, double speed)
+void dc_motor_set_rate(dc_motor_context_t *dc_motor_context, uint32_t counts, uint32_t interval_us)
 {
-    dc_motor_context->target_speed = speed;
+    dc_motor_context->rate_counts = counts;
+    dc_motor_context->rate_interval_us = interval_us;
+
+    dc_motor_cmd_t cmd = { .type = DC_MOTOR_CMD_SET_RATE };
+    rate_set(&cmd.rate, counts, interval_us);
+    dc_motor_post(dc_motor_context, &cmd);
 }
 
 void dc_motor_set_target(dc_motor_context_t *dc_motor_context, int32_t target)
@@ -273,6 +773,11 @@ void dc_motor_set_target(dc_motor_context_t *dc_motor_context, int32_t target)
     dc_motor_context->target = target;
 }
 
+void dc_motor_set_worm_phase(dc_motor_context_t *dc_motor_context, int32_t worm_phase)
+{
+    dc_motor_context->worm_phase = worm_phase;
+}
+
 bool dc_motor_get_direction(dc_motor_context_t *dc_motor_context)
 {
     return dc_motor_context->direction;
@@ -280,7 +785,9 @@ bool dc_motor_get_direction(dc_motor_context_t *dc_motor_context)
 
 bool dc_motor_get_running(dc_motor_context_t *dc_motor_context)
 {
-    return dc_motor_context->running;
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    return snapshot.running;
 }
 
 bool dc_motor_get_stop_at_target(dc_motor_context_t *dc_motor_context)
@@ -295,7 +802,9 @@ bool dc_motor_get_init(dc_motor_context_t *dc_motor_context)
 
 int32_t dc_motor_get_position(dc_motor_context_t *dc_motor_context)
 {
-    return dc_motor_context->pulse_count;
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    return snapshot.position;
 }
 
 int32_t dc_motor_get_target(dc_motor_context_t *dc_motor_context)
@@ -303,20 +812,107 @@ int32_t dc_motor_get_target(dc_motor_context_t *dc_motor_context)
     return dc_motor_context->target;
 }
 
+dc_motor_regime_t dc_motor_get_regime(dc_motor_context_t *dc_motor_context)
+{
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    return snapshot.regime;
+}
+
+int32_t dc_motor_get_worm_phase(dc_motor_context_t *dc_motor_context)
+{
+    return __atomic_load_n(&dc_motor_context->worm_phase, __ATOMIC_RELAXED);
+}
+
+void dc_motor_get_rate(dc_motor_context_t *dc_motor_context, uint32_t *counts, uint32_t *interval_us)
+{
+    *counts = dc_motor_context->rate_counts;
+    *interval_us = dc_motor_context->rate_interval_us;
+}
+
 double dc_motor_get_speed(dc_motor_context_t *dc_motor_context)
 {
-    return dc_motor_context->target_speed;
+    dc_motor_snapshot_t snapshot;
+    dc_motor_get_snapshot(dc_motor_context, &snapshot);
+    return PID_VALUE_TO_DOUBLE(snapshot.target_speed);
+}
+
+void dc_motor_get_snapshot(dc_motor_context_t *dc_motor_context, dc_motor_snapshot_t *snapshot)
+{
+    dc_motor_sync(dc_motor_context);
+
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&dc_motor_context->snapshot_seq, __ATOMIC_ACQUIRE);
+        *snapshot = dc_motor_context->snapshot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&dc_motor_context->snapshot_seq, __ATOMIC_RELAXED)));
 }
 
 
 
+// the control state of both axes is used from the scheduler ISR, keep it in
+// internal RAM; defined after the motor code, whose functions take the context
+// as a parameter of the same name
+DRAM_ATTR dc_motor_context_t dc_motor_context = {
+    .rate_counts = DC_MOTOR_BASE_SPEED,
+    .rate_interval_us = 1000000,
+    // the gains the 20 Hz loop had per period, Kp 0.0030, Ki 0.0003, Kd 0.0010;
+    // the same in every regime until autotune derives separate ones
+    .tuning = {
+        [DC_MOTOR_REGIME_TRACKING] = { .kp = 0.0030, .ki = 0.0060, .kd = 0.00005 },
+        [DC_MOTOR_REGIME_SLEW] = { .kp = 0.0030, .ki = 0.0060, .kd = 0.00005 },
+        [DC_MOTOR_REGIME_GUIDING] = { .kp = 0.0030, .ki = 0.0060, .kd = 0.00005 },
+    },
+    .slew_speed = 4000,
+    .slew_accel = 1600,
+};
+
+DRAM_ATTR stepper_context_t stepper_context = {
+    .rate_interval_us = 1000000,
+    .slew_speed = 4000,
+    .slew_accel = 8000,
+};
+
+axis_t axes[AXES] = {
+    {
+        .type = AXIS_DC_MOTOR,
+        .dc_motor = &dc_motor_context,
+        .steps_mul = DC_MOTOR_STEPS_MUL,
+        .worm_period = DC_WORM_PERIOD,
+        .high_speed = 16,
+    },
+    {
+        .type = AXIS_STEPPER,
+        .stepper = &stepper_context,
+        .steps_mul = 1,
+        .worm_period = STEPPER_WORM_PERIOD,
+        .high_speed = 16,
+    },
+};
+
+// runs on CONTROL_CORE, the motor interrupts are allocated there
 void setup()
 {
+    esp_err_t err = nvs_flash_init();
+    if ((err == ESP_ERR_NVS_NO_FREE_PAGES) || (err == ESP_ERR_NVS_NEW_VERSION_FOUND)) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+
+    replay_init();
+    for (int i = 0; i < AXES; i++) axis_init(&axes[i]);
+    st4_init();
+    persist_restore();
+    sw_protocol_init();
+    telemetry_init();
+    stream_init();
+    power_init();
+    bench_init();
+    scheduler_start();
+    persist_init();
 
-    task_to_notify = xTaskGetCurrentTaskHandle();
-
-    dc_motor_init(&dc_motor_context);
-    
 //    dc_motor_context.direction = true;
 //    dc_motor_start(&dc_motor_context);
 //    esp_rom_gpio_pad_select_gpio(ENC1_GPIO);
@@ -326,12 +922,6 @@ void setup()
 }
 
 
-int handle_command(char *cmd, char *resp);
-
-char cmd[256];
-int  cmdpos = 0;
-char resp[30];
-
 void loop()
 {
 
@@ -353,41 +943,38 @@ void loop()
 //    if (pdTICKS_TO_MS(xTaskGetTickCount()) % 60000 < 30000) target = 3000000; else target = 6000000;
 
 
-    int ch = fgetc(stdin);
-    if (ch > 0) {
-        //printf("%d %d\n", ch, cmdpos);
-        if (ch == ':') {
-            cmd[0] = ch;
-            cmdpos = 1;
-        }
-        else if ((cmdpos > 0) && (cmdpos < 255)) {
-            cmd[cmdpos++] = ch;
-            if ((ch == 0x0d) || (ch == 0x0a)) {
-                //printf("%d\n", cmd[3]);
-                handle_command(cmd, resp);
-                printf("%s", resp);
-                cmdpos = 0;
-            }
-        }
-    }
+    eqmod_uart_poll();
 }
 
 TaskHandle_t loopTaskHandle = NULL;
+TaskHandle_t commsTaskHandle = NULL;
 
-void loopTask(void *pvParameters)
+// blocked on UART events, the UART and WiFi interrupts go to COMMS_CORE
+void commsTask(void *pvParameters)
 {
-    setup();
-    loop();
-    
+    // host build with SA_REPLAY or SA_BENCH, runs the capture or benchmark and exits
+    replay_run();
+    bench_run();
+
+    eqmod_uart_init();
+    udp_server_init();
+
 //    esp_ota_mark_app_valid_cancel_rollback();
-    
+
     while(1) {
         loop();
     }
 }
 
+void loopTask(void *pvParameters)
+{
+    setup();
+    xTaskCreatePinnedToCore(commsTask, "comms", 8192, NULL, COMMS_TASK_PRIORITY, &commsTaskHandle, COMMS_CORE);
+    vTaskDelete(NULL);
+}
+
 //extern "C" 
 void app_main()
 {
-    xTaskCreatePinnedToCore(loopTask, "loopTask", 8192, NULL, 0, &loopTaskHandle, 1);
+    xTaskCreatePinnedToCore(loopTask, "loopTask", 8192, NULL, 0, &loopTaskHandle, CONTROL_CORE);
 }
@@ -0,0 +1,79 @@
+#include "esp_attr.h"
+
+#include "guide.h"
+#include "scheduler.h"
+
+// integrates the offset up to time, it only changes at the end of the pulse in between
+static void IRAM_ATTR guide_advance(guide_t *guide, int64_t time)
+{
+    while (guide->since < time) {
+        int64_t end = time;
+        int32_t direction = guide->direction;
+        if (guide->since < guide->pulse_stop) {
+            if (guide->pulse_stop < end) end = guide->pulse_stop;
+            direction += guide->pulse_direction;
+        }
+        guide->accum += (int64_t)guide->rate * direction * (end - guide->since) / CONTROL_PERIOD_US;
+        guide->since = end;
+    }
+}
+
+void guide_init(guide_t *guide)
+{
+    portMUX_INITIALIZE(&guide->lock);
+    guide->rate = 0;
+    guide->direction = 0;
+    guide->pulse_direction = 0;
+    guide->pulse_stop = 0;
+    guide->since = scheduler_get_time();
+    guide->accum = 0;
+}
+
+void guide_set_rate(guide_t *guide, int32_t rate)
+{
+    portENTER_CRITICAL_SAFE(&guide->lock);
+    guide_advance(guide, scheduler_get_time());
+    guide->rate = rate;
+    portEXIT_CRITICAL_SAFE(&guide->lock);
+}
+
+void guide_pulse(guide_t *guide, int32_t direction, uint32_t duration_us)
+{
+    portENTER_CRITICAL_SAFE(&guide->lock);
+    int64_t now = scheduler_get_time();
+    guide_advance(guide, now);
+    guide->pulse_direction = direction;
+    guide->pulse_stop = now + duration_us;
+    portEXIT_CRITICAL_SAFE(&guide->lock);
+}
+
+bool guide_get_pulse_active(guide_t *guide)
+{
+    portENTER_CRITICAL_SAFE(&guide->lock);
+    bool active = (guide->pulse_direction != 0) && (scheduler_get_time() < guide->pulse_stop);
+    portEXIT_CRITICAL_SAFE(&guide->lock);
+    return active;
+}
+
+void IRAM_ATTR guide_set_direction(guide_t *guide, int32_t direction, int64_t time)
+{
+    portENTER_CRITICAL_SAFE(&guide->lock);
+    guide_advance(guide, time);
+    guide->direction = direction;
+    portEXIT_CRITICAL_SAFE(&guide->lock);
+}
+
+int32_t guide_get_direction(guide_t *guide)
+{
+    return __atomic_load_n(&guide->direction, __ATOMIC_RELAXED);
+}
+
+int32_t IRAM_ATTR guide_take(guide_t *guide, int64_t now)
+{
+    portENTER_CRITICAL_SAFE(&guide->lock);
+    guide_advance(guide, now);
+    int32_t counts = guide->accum;
+    guide->accum = 0;
+    portEXIT_CRITICAL_SAFE(&guide->lock);
+    return counts;
+}
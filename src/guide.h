@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+// guide corrections are a rate offset switched at microsecond timestamps, the
+// control step takes exactly the part of it that falls into its period, so a
+// pulse is not rounded to CONTROL_PERIOD_US. Directions are +1 to increase the
+// position, -1 to decrease it.
+typedef struct {
+    portMUX_TYPE lock;
+    int32_t rate;             // counts per control period, Q16
+    int32_t direction;        // held by the ST-4 input
+    int32_t pulse_direction;
+    int64_t pulse_stop;       // us
+    int64_t since;            // us, integrated up to here
+    int64_t accum;            // counts not yet taken, Q16
+} guide_t;
+
+void guide_init(guide_t *guide);
+void guide_set_rate(guide_t *guide, int32_t rate);
+
+// timed pulse from now, a new one replaces the running one
+void guide_pulse(guide_t *guide, int32_t direction, uint32_t duration_us);
+bool guide_get_pulse_active(guide_t *guide);
+// from the ST-4 edge interrupt with the edge time
+void guide_set_direction(guide_t *guide, int32_t direction, int64_t time);
+int32_t guide_get_direction(guide_t *guide);
+
+// control ISR, counts of offset since the last call, Q16
+int32_t guide_take(guide_t *guide, int64_t now);
@@ -0,0 +1,58 @@
+#include <math.h>
+
+#include "motion_profile.h"
+
+void motion_profile_plan(motion_profile_t *profile, double distance, double max_speed, double accel)
+{
+    profile->active = false;
+    profile->period = 0;
+#if DC_MOTOR_FIXED_PID
+    profile->remaining = llround(distance * (1 << PID_VALUE_SHIFT));
+#else
+    profile->remaining = distance;
+#endif
+    if (profile->remaining <= 0) return;
+
+    // planned in setpoint units, so the fixed point setpoints add up exactly
+    motion_distance_t total = profile->remaining;
+    motion_distance_t a = PID_VALUE(accel);
+
+    // n periods of acceleration and n - 1 of deceleration cover a * n^2
+    int32_t n = floor(max_speed / accel);
+    if (n < 1) n = 1;
+    int32_t n_dist = floor(sqrt((double)total / a));
+    while ((motion_distance_t)(n_dist + 1) * (n_dist + 1) * a <= total) n_dist++;
+    while ((n_dist > 0) && ((motion_distance_t)n_dist * n_dist * a > total)) n_dist--;
+    if (n_dist < n) n = n_dist;
+
+    // whole periods at n * a, what they leave goes into one extra period
+    // between the ramp down speeds j * a and (j + 1) * a
+    motion_distance_t rest = total - (motion_distance_t)n * n * a;
+    int32_t cruise = 0;
+    motion_distance_t extra = rest;
+    if (n > 0) {
+#if DC_MOTOR_FIXED_PID
+        cruise = rest / (n * a);
+#else
+        cruise = floor(rest / (n * a));
+#endif
+        extra = rest - cruise * n * a;
+        if (extra < 0) extra = 0;
+    }
+#if DC_MOTOR_FIXED_PID
+    int32_t j = extra / a;
+#else
+    int32_t j = floor(extra / a);
+#endif
+    if (j > n - 1) j = n - 1;
+    if (j < 0) j = 0;
+
+    profile->accel = a;
+    profile->cruise_speed = n * a;
+    profile->extra_speed = extra;
+    profile->acc_end = n;
+    profile->cruise_end = n + cruise;
+    profile->extra_at = profile->cruise_end + ((n > 0) ? n - 1 - j : 0);
+    profile->dec_end = profile->cruise_end + ((n > 0) ? n - 1 : 0) + 1;
+    profile->active = true;
+}
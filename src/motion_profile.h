@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pid.h"
+
+// acceleration limited move over a given distance, planned in task context
+// and consumed by the control ISR one period at a time: the speed ramps up by
+// accel per period, cruises and ramps down again, so that the sum of all
+// setpoints is exactly the distance. What the whole periods at cruise speed
+// leave over is one extra period, slotted into the ramp down between the two
+// speeds it lies between, so no step exceeds accel.
+
+#if DC_MOTOR_FIXED_PID
+// Q16 like pid_value_t, gotos run past the 32767 counts of an int32_t
+typedef int64_t motion_distance_t;
+#else
+typedef double motion_distance_t;
+#endif
+
+typedef struct {
+    pid_value_t accel;        // speed change per period
+    pid_value_t cruise_speed;
+    pid_value_t extra_speed;
+    int32_t acc_end;          // first period of cruise
+    int32_t cruise_end;       // first period of deceleration
+    int32_t extra_at;         // the period at extra_speed
+    int32_t dec_end;          // the move is complete after this period
+
+    int32_t period;
+    motion_distance_t remaining; // planned distance not yet handed out
+    bool active;
+} motion_profile_t;
+
+void motion_profile_plan(motion_profile_t *profile, double distance, double max_speed, double accel);
+
+// speed setpoint for the next control period, 0 once the whole distance is handed out
+static inline pid_value_t motion_profile_next(motion_profile_t *profile)
+{
+    if (!profile->active) return 0;
+
+    int32_t t = profile->period++;
+    pid_value_t speed;
+    if (t < profile->acc_end) speed = profile->accel * (t + 1);
+    else if (t < profile->cruise_end) speed = profile->cruise_speed;
+    else if (t == profile->extra_at) speed = profile->extra_speed;
+    else if (t < profile->extra_at) speed = profile->accel * (profile->dec_end - 1 - t);
+    else if (t < profile->dec_end) speed = profile->accel * (profile->dec_end - t);
+    else speed = profile->remaining; // rounding leftover
+
+    if (speed > profile->remaining) speed = profile->remaining;
+    profile->remaining -= speed;
+    if (profile->remaining <= 0) profile->active = false;
+    return speed;
+}
@@ -1,43 +1,201 @@
-#include "driver/pulse_cnt.h"
+#pragma once
 
-#include "driver/mcpwm_prelude.h"
-//#include "soc/mcpwm_periph.h"
+#include "dc_motor_hal.h"
+#include "pid.h"
+#include "motion_profile.h"
+#include "pec.h"
+#include "autotune.h"
+#include "guide.h"
+#include "duty_map.h"
+#include "backlash.h"
+#include "rate.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
+// what the control ISR is doing, prepared in task context and taken over on start
 typedef struct {
-    mcpwm_timer_handle_t timer;
-    mcpwm_cmpr_handle_t comparator;
-    mcpwm_gen_handle_t generator1;
-    mcpwm_gen_handle_t generator2;
-    pcnt_unit_handle_t pcnt_unit;
+    bool direction;
+    bool stop_at_target;
+    int32_t target;
+    motion_profile_t profile;
+    uint32_t takeup;          // backlash counts, not counted as position
+    motion_profile_t takeup_profile;
+    bool measure;             // backlash measurement, no feedforward
+} dc_motor_run_t;
+
+// gain sets, picked by the control ISR every period: slew for gotos and fast
+// rates, guiding for a while after a guide correction, tracking otherwise
+typedef enum {
+    DC_MOTOR_REGIME_TRACKING,
+    DC_MOTOR_REGIME_SLEW,
+    DC_MOTOR_REGIME_GUIDING,
+    DC_MOTOR_REGIMES,
+} dc_motor_regime_t;
+
+typedef struct {
+    pid_gain_t Kp;
+    pid_gain_t Ki;
+    pid_gain_t Kd;
+} dc_motor_gains_t;
+
+// continuous time gains, see DC_MOTOR_KP
+typedef struct {
+    double kp;
+    double ki;
+    double kd;
+} dc_motor_tuning_t;
+
+typedef enum {
+    DC_MOTOR_CMD_START,
+    DC_MOTOR_CMD_STOP,
+    DC_MOTOR_CMD_SET_POSITION,
+    DC_MOTOR_CMD_SET_RATE,
+    DC_MOTOR_CMD_SET_GAINS,
+    DC_MOTOR_CMD_AUTOTUNE,
+} dc_motor_cmd_type_t;
+
+// setpoint change for the control ISR
+typedef struct {
+    dc_motor_cmd_type_t type;
+    union {
+        int32_t position;
+        rate_t rate;
+        struct {
+            dc_motor_regime_t regime;
+            dc_motor_gains_t gains;
+        };
+        pid_gain_t amplitude;   // of the autotune relay
+    };
+} dc_motor_cmd_t;
+
+#define DC_MOTOR_MAILBOX_SIZE 8
 
-    double target_speed;
+// published by the control ISR once per period
+typedef struct {
+    int32_t position;
+    int32_t speed;            // counts in the last period
+    pid_value_t target_speed;
+    pid_value_t idif;
+    int32_t comp_value;
+    bool running;
+    bool direction;           // of the run
+    bool stop_at_target;
+    int32_t target;
+    pid_value_t run_speed;    // setpoint of the last period
+    pid_gain_t pid_output;
+    bool settled;             // steady setpoint and small error, see DC_MOTOR_SETTLE_MS
+    dc_motor_regime_t regime;
+} dc_motor_snapshot_t;
+
+typedef struct {
+    dc_motor_hal_t hal;
+
+    // owned by the control ISR
+    rate_t rate;              // tracking setpoints
     int32_t comp_value;
     
-    double pid_output;
-    double prev_error;
-    double prev_error2;
+    pid_gain_t pid_output;
+    pid_value_t prev_error;
+    pid_value_t prev_error2;
+
+    // gains of the current regime, taken from the regime table when it changes
+    pid_gain_t Kp;
+    pid_gain_t Ki;
+    pid_gain_t Kd;
+    dc_motor_gains_t gains[DC_MOTOR_REGIMES];
+    dc_motor_regime_t regime;
+    int32_t guide_periods;    // left of the guiding hold
+    autotune_t autotune;
 
-    double Kp;
-    double Ki;
-    double Kd;
+    pid_value_t dif;
+    pid_value_t idif;
 
-    double dif;
-    double idif;
+    // feedforward from the duty map for run_speed, the PID output follows its changes
+    duty_map_t duty_map;
+    pid_value_t run_speed;
+    pid_gain_t ff_duty;
+    bool ff_valid;
+    int32_t settle_periods;
+
+    // sub-count position interpolated from the encoder edge times
+    dc_motor_hal_edge_t last_edge;
+    int32_t edge_speed;       // counts per period, Q16, magnitude
+    int32_t fraction;         // Q16, in the counter direction
 
     int32_t pulse_count;
     int32_t accumu_count;
-    
-    int32_t target;
-    
-    bool direction;
+
+    dc_motor_run_t run;
     bool running;
+
+    // counts into the worm revolution, not moved by :E
+    int32_t worm_phase;
+    pec_t pec;
+
+    // written by the command handlers and the ST-4 input, taken by the ISR
+    guide_t guide;
+
+    // owned by the control task
+    int32_t stall_position;
+    int32_t stall_periods;
+
+    // producers serialized by post_lock, single consumer (the ISR)
+    SemaphoreHandle_t post_lock;
+    dc_motor_cmd_t mailbox[DC_MOTOR_MAILBOX_SIZE];
+    uint32_t mailbox_head;
+    uint32_t mailbox_tail;
+
+    // seqlock, odd while the ISR is writing
+    uint32_t snapshot_seq;
+    dc_motor_snapshot_t snapshot;
+
+    // owned by the command handlers
+    dc_motor_run_t next_run;
+    uint32_t rate_counts;     // tracking rate, counts every rate_interval_us
+    uint32_t rate_interval_us;
+    double slew_speed;        // counts per second
+    double slew_accel;        // counts per second^2
+    dc_motor_tuning_t tuning[DC_MOTOR_REGIMES];
+    backlash_t backlash;
+
+    bool direction;
     bool stop_at_target;
+    int32_t target;
     bool init;
 
 } dc_motor_context_t;
 
-#define DC_MOTOR_BASE_SPEED 5
+// the position is interpolated between encoder edges up to EDGE_LOW counts per
+// period, above EDGE_HIGH the plain count difference is used, blended in between
+#define DC_MOTOR_SPEED_EDGE_LOW 4
+#define DC_MOTOR_SPEED_EDGE_HIGH 8
+
+#define DC_MOTOR_BASE_SPEED 100   // counts per second, about sidereal
+
+// a setpoint above SLEW_SPEED switches to the slew gains, back below
+// SLEW_EXIT_SPEED to the tracking ones; the guiding gains stay for GUIDE_HOLD_MS
+// after the last guide correction
+#define DC_MOTOR_SLEW_SPEED 800   // counts per second
+#define DC_MOTOR_SLEW_EXIT_SPEED 600
+#define DC_MOTOR_GUIDE_HOLD_MS 1000
+
+// the duty map learns once the setpoint changed by less than 1/64 and the
+// position error stayed within DC_MOTOR_SETTLE_ERROR counts for this long
+#define DC_MOTOR_SETTLE_MS 500
+#define DC_MOTOR_SETTLE_ERROR 4
+
+// full duty without a single count for this long stops the motor
+#define DC_MOTOR_STALL_MS 2000
+
+// continuous time gains, duty per count of position error, converted to the
+// discrete gains of the ISR for CONTROL_RATE_HZ
+#define DC_MOTOR_KP(kp) PID_GAIN(kp)
+#define DC_MOTOR_KI(ki) PID_GAIN((ki) / CONTROL_RATE_HZ)  // per second
+#define DC_MOTOR_KD(kd) PID_GAIN((kd) * CONTROL_RATE_HZ)  // seconds
 #define DC_WORM_PERIOD (300 * 200)
+#define DC_MOTOR_STEPS_MUL 4       // encoder counts per EQMOD step
+
+void dc_motor_init(dc_motor_context_t *dc_motor_context);
 
 void dc_motor_start(dc_motor_context_t *dc_motor_context);
 void dc_motor_stop(dc_motor_context_t *dc_motor_context);
@@ -47,7 +205,12 @@ void dc_motor_set_stop_at_target(dc_motor_context_t *dc_motor_context, bool stop
 void dc_motor_set_init(dc_motor_context_t *dc_motor_context, bool init);
 void dc_motor_set_position(dc_motor_context_t *dc_motor_context, int32_t position);
 void dc_motor_set_target(dc_motor_context_t *dc_motor_context, int32_t target);
-void dc_motor_set_speed(dc_motor_context_t *dc_motor_context, double speed);
+// tracking rate, counts every interval_us, kept exactly over any time
+void dc_motor_set_rate(dc_motor_context_t *dc_motor_context, uint32_t counts, uint32_t interval_us);
+// power management, with the control step suspended and the motor stopped
+void dc_motor_suspend(dc_motor_context_t *dc_motor_context, bool suspend);
+// the ISR owns the phase, set only before scheduler_start
+void dc_motor_set_worm_phase(dc_motor_context_t *dc_motor_context, int32_t worm_phase);
 
 bool dc_motor_get_direction(dc_motor_context_t *dc_motor_context);
 bool dc_motor_get_running(dc_motor_context_t *dc_motor_context);
@@ -56,3 +219,26 @@ bool dc_motor_get_init(dc_motor_context_t *dc_motor_context);
 int32_t dc_motor_get_position(dc_motor_context_t *dc_motor_context);
 int32_t dc_motor_get_target(dc_motor_context_t *dc_motor_context);
 double dc_motor_get_speed(dc_motor_context_t *dc_motor_context);
+void dc_motor_get_rate(dc_motor_context_t *dc_motor_context, uint32_t *counts, uint32_t *interval_us);
+int32_t dc_motor_get_worm_phase(dc_motor_context_t *dc_motor_context);
+// gain set used in the last control period
+dc_motor_regime_t dc_motor_get_regime(dc_motor_context_t *dc_motor_context);
+
+// converts to the discrete gains of the ISR, save_tuning keeps them in NVS
+void dc_motor_set_tuning(dc_motor_context_t *dc_motor_context, dc_motor_regime_t regime, const dc_motor_tuning_t *tuning);
+void dc_motor_save_tuning(dc_motor_context_t *dc_motor_context);
+
+// relay autotune while tracking, amplitude as a fraction of full duty, 0 picks one;
+// the new gains are applied and saved when it finishes
+bool dc_motor_autotune(dc_motor_context_t *dc_motor_context, double amplitude);
+autotune_state_t dc_motor_get_autotune_state(dc_motor_context_t *dc_motor_context);
+
+// backlash in counts, stored in NVS and taken up at the start of a reversed run
+void dc_motor_set_backlash(dc_motor_context_t *dc_motor_context, uint32_t counts);
+// measures it while stopped by reversing around the current position, see
+// backlash.h; the result is applied and saved when it finishes
+bool dc_motor_measure_backlash(dc_motor_context_t *dc_motor_context);
+backlash_state_t dc_motor_get_backlash_state(dc_motor_context_t *dc_motor_context);
+
+// consistent copy of the control state, waits for commands still in the mailbox
+void dc_motor_get_snapshot(dc_motor_context_t *dc_motor_context, dc_motor_snapshot_t *snapshot);
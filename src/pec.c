@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+#include "esp_attr.h"
+
+#include "pec.h"
+#include "dc_motor_hal.h"
+
+#define PEC_NVS_NAMESPACE "pec"
+#define PEC_NVS_KEY "table"
+
+// stored as Q16 counts per second, independent of the control rate
+static void pec_store(const pid_value_t *table)
+{
+    int32_t blob[PEC_BINS];
+    for (int i = 0; i < PEC_BINS; i++) blob[i] = PID_VALUE_TO_Q16(table[i]) * CONTROL_RATE_HZ;
+
+    nvs_handle_t handle;
+    if (nvs_open(PEC_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_set_blob(handle, PEC_NVS_KEY, blob, sizeof(blob));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static bool pec_load(pid_value_t *table)
+{
+    int32_t blob[PEC_BINS];
+    size_t len = sizeof(blob);
+
+    nvs_handle_t handle;
+    if (nvs_open(PEC_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return false;
+    esp_err_t err = nvs_get_blob(handle, PEC_NVS_KEY, blob, &len);
+    nvs_close(handle);
+    if ((err != ESP_OK) || (len != sizeof(blob))) return false;
+
+    for (int i = 0; i < PEC_BINS; i++) table[i] = PID_VALUE_FROM_Q16(blob[i] / CONTROL_RATE_HZ);
+    return true;
+}
+
+void pec_init(pec_t *pec, int32_t worm_period)
+{
+    memset(pec, 0, sizeof(*pec));
+    pec->worm_period = worm_period;
+    pec->bin_counts = worm_period / PEC_BINS;
+
+    pec->valid = pec_load(pec->table[0]);
+    pec->enabled = pec->valid;
+}
+
+bool pec_start_recording(pec_t *pec, int32_t cycles)
+{
+    if (__atomic_load_n(&pec->recording, __ATOMIC_ACQUIRE) || (cycles <= 0)) return false;
+
+    memset(pec->sum, 0, sizeof(pec->sum));
+    memset(pec->samples, 0, sizeof(pec->samples));
+    pec->record_remaining = cycles * pec->worm_period;
+    __atomic_store_n(&pec->recording, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void pec_stop_recording(pec_t *pec)
+{
+    __atomic_store_n(&pec->recording, false, __ATOMIC_RELEASE);
+}
+
+void IRAM_ATTR pec_record(pec_t *pec, int32_t phase, int32_t counts, pid_value_t speed)
+{
+    if (!__atomic_load_n(&pec->recording, __ATOMIC_ACQUIRE)) return;
+
+    int32_t bin = phase / pec->bin_counts;
+    pec->sum[bin] += PID_VALUE_TO_Q16(speed);
+    pec->samples[bin]++;
+
+    pec->record_remaining -= abs(counts);
+    if (pec->record_remaining <= 0) __atomic_store_n(&pec->recording, false, __ATOMIC_RELEASE);
+}
+
+bool pec_save(pec_t *pec)
+{
+    if (__atomic_load_n(&pec->recording, __ATOMIC_ACQUIRE)) return false;
+
+    int64_t avg[PEC_BINS];
+    int64_t mean = 0;
+    for (int i = 0; i < PEC_BINS; i++) {
+        if (pec->samples[i] == 0) return false;
+        avg[i] = pec->sum[i] / pec->samples[i];
+        mean += avg[i];
+    }
+    mean /= PEC_BINS;
+
+    // 1-2-1 smoothing around the worm, without the mean the table does not shift the position
+    uint32_t next = !pec->active;
+    for (int i = 0; i < PEC_BINS; i++) {
+        int64_t prev = avg[(i + PEC_BINS - 1) % PEC_BINS];
+        int64_t succ = avg[(i + 1) % PEC_BINS];
+        pec->table[next][i] = PID_VALUE_FROM_Q16((prev + 2 * avg[i] + succ) / 4 - mean);
+    }
+    __atomic_store_n(&pec->active, next, __ATOMIC_RELEASE);
+    pec->valid = true;
+    pec_store(pec->table[next]);
+    pec_enable(pec, true);
+    return true;
+}
+
+void pec_enable(pec_t *pec, bool enable)
+{
+    __atomic_store_n(&pec->enabled, enable && pec->valid, __ATOMIC_RELEASE);
+}
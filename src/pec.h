@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pid.h"
+
+// periodic error correction: a speed offset per worm phase bin, recorded from
+// the speed setpoint while tracking (guide corrections included) and played
+// back as feedforward
+#define PEC_BINS 120
+
+typedef struct {
+    // the ISR plays the active table, a new one is built in the other
+    pid_value_t table[2][PEC_BINS];  // counts per period in the counter direction
+    uint32_t active;
+    bool enabled;
+    bool valid;
+
+    int32_t worm_period;             // counts
+    int32_t bin_counts;
+
+    // filled by the ISR while recording
+    bool recording;
+    int32_t record_remaining;        // counts still to record
+    int64_t sum[PEC_BINS];           // Q16
+    uint32_t samples[PEC_BINS];
+} pec_t;
+
+// loads a stored table from NVS
+void pec_init(pec_t *pec, int32_t worm_period);
+
+// task context
+bool pec_start_recording(pec_t *pec, int32_t cycles);
+void pec_stop_recording(pec_t *pec);
+// averages and smooths the finished recording, stores it in NVS and enables playback
+bool pec_save(pec_t *pec);
+void pec_enable(pec_t *pec, bool enable);
+
+// control ISR, phase in [0, worm_period), speed in the counter direction
+void pec_record(pec_t *pec, int32_t phase, int32_t counts, pid_value_t speed);
+
+// control ISR, interpolated between the bin centers
+static inline pid_value_t pec_feedforward(const pec_t *pec, int32_t phase)
+{
+    if (!__atomic_load_n(&pec->enabled, __ATOMIC_ACQUIRE)) return 0;
+    const pid_value_t *table = pec->table[__atomic_load_n(&pec->active, __ATOMIC_ACQUIRE)];
+
+    phase -= pec->bin_counts / 2;
+    if (phase < 0) phase += pec->worm_period;
+    int32_t bin = phase / pec->bin_counts;
+    int32_t frac = phase - bin * pec->bin_counts;
+    pid_value_t t0 = table[bin];
+    pid_value_t t1 = table[(bin + 1 < PEC_BINS) ? bin + 1 : 0];
+    return t0 + (t1 - t0) * frac / pec->bin_counts;
+}
@@ -0,0 +1,187 @@
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "persist.h"
+
+#define PERSIST_NVS_NAMESPACE "persist"
+#define PERSIST_MAGIC 0x53414550  // "PEAS"
+
+typedef struct {
+    int32_t position;
+    int32_t worm_phase;
+    uint8_t init;
+    uint8_t reserved[3];
+} persist_axis_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    persist_axis_t axes[AXES];
+    uint32_t crc;
+} persist_record_t;
+
+// not cleared on a soft reset, random after power on, the CRC tells
+static RTC_NOINIT_ATTR persist_record_t rtc_record;
+
+static persist_record_t last_record;   // last journal write
+
+static TaskHandle_t persist_handle;
+static bool suspended;
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    const uint8_t *b = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *b++;
+        for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void persist_seal(persist_record_t *record)
+{
+    record->magic = PERSIST_MAGIC;
+    record->crc = crc32(record, offsetof(persist_record_t, crc));
+}
+
+static bool persist_valid(const persist_record_t *record)
+{
+    return (record->magic == PERSIST_MAGIC) && (record->crc == crc32(record, offsetof(persist_record_t, crc)));
+}
+
+static void persist_slot_key(char *key, uint32_t seq)
+{
+    key[0] = 'j';
+    key[1] = '0' + seq % PERSIST_JOURNAL_SLOTS;
+    key[2] = 0;
+}
+
+// the valid record with the highest sequence number
+static bool persist_journal_load(persist_record_t *record)
+{
+    nvs_handle_t handle;
+    if (nvs_open(PERSIST_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return false;
+
+    bool found = false;
+    for (uint32_t i = 0; i < PERSIST_JOURNAL_SLOTS; i++) {
+        persist_record_t slot;
+        size_t len = sizeof(slot);
+        char key[4];
+        persist_slot_key(key, i);
+        if (nvs_get_blob(handle, key, &slot, &len) != ESP_OK) continue;
+        if ((len != sizeof(slot)) || !persist_valid(&slot)) continue;
+        if (found && ((int32_t)(slot.seq - record->seq) <= 0)) continue;
+        *record = slot;
+        found = true;
+    }
+    nvs_close(handle);
+    return found;
+}
+
+static void persist_journal_store(const persist_record_t *record)
+{
+    char key[4];
+    persist_slot_key(key, record->seq);
+
+    nvs_handle_t handle;
+    if (nvs_open(PERSIST_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+    nvs_set_blob(handle, key, record, sizeof(*record));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static void persist_capture(persist_record_t *record)
+{
+    memset(record->axes, 0, sizeof(record->axes));
+    for (int i = 0; i < AXES; i++) {
+        record->axes[i].position = axis_get_position(&axes[i]);
+        record->axes[i].worm_phase = axis_get_worm_phase(&axes[i]);
+        record->axes[i].init = axis_get_init(&axes[i]);
+    }
+}
+
+persist_source_t persist_restore(void)
+{
+    persist_source_t source = PERSIST_NONE;
+    persist_record_t record;
+
+    if (persist_valid(&rtc_record)) {
+        record = rtc_record;
+        source = PERSIST_RTC;
+    }
+    if (persist_journal_load(&last_record)) {
+        if (source == PERSIST_NONE) {
+            record = last_record;
+            source = PERSIST_JOURNAL;
+        }
+    }
+    else {
+        last_record.seq = 0;
+    }
+    if (source == PERSIST_NONE) return source;
+
+    for (int i = 0; i < AXES; i++) {
+        axis_set_position(&axes[i], record.axes[i].position);
+        axis_set_worm_phase(&axes[i], record.axes[i].worm_phase);
+        axis_set_init(&axes[i], record.axes[i].init);
+    }
+    return source;
+}
+
+static bool persist_changed(const persist_record_t *a, const persist_record_t *b)
+{
+    return memcmp(a->axes, b->axes, sizeof(a->axes)) != 0;
+}
+
+static void persist_task(void *pvParameters)
+{
+    TickType_t last_write = xTaskGetTickCount();
+    persist_record_t record;
+    bool pending = false;     // a change not journaled yet
+
+    while (1) {
+        if (!pending && __atomic_load_n(&suspended, __ATOMIC_ACQUIRE)) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        else vTaskDelay(pdMS_TO_TICKS(PERSIST_RTC_PERIOD_MS));
+
+        persist_capture(&record);
+        record.seq = 0;
+        persist_seal(&record);
+        rtc_record = record;
+
+        pending = persist_changed(&record, &last_record);
+        if (!pending) continue;
+
+        bool running = false;
+        for (int i = 0; i < AXES; i++) running |= axis_get_running(&axes[i]);
+        TickType_t elapsed = xTaskGetTickCount() - last_write;
+        if (elapsed < pdMS_TO_TICKS((running ? PERSIST_JOURNAL_PERIOD_S : PERSIST_JOURNAL_MIN_S) * 1000)) continue;
+
+        record.seq = last_record.seq + 1;
+        persist_seal(&record);
+        persist_journal_store(&record);
+        last_record = record;
+        last_write = xTaskGetTickCount();
+        pending = false;
+    }
+}
+
+void persist_init(void)
+{
+    xTaskCreatePinnedToCore(persist_task, "persist", 2048, NULL, 1, &persist_handle, COMMS_CORE);
+}
+
+void persist_suspend(bool suspend)
+{
+    __atomic_store_n(&suspended, suspend, __ATOMIC_RELEASE);
+    if (!suspend) persist_command_end();
+}
+
+void persist_command_end(void)
+{
+    if (persist_handle) xTaskNotifyGive(persist_handle);
+}
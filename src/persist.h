@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "axis.h"
+
+// mount position kept across resets: a copy in RTC slow memory survives soft
+// resets and crashes, a journal in NVS survives power cycles. The journal is a
+// ring of PERSIST_JOURNAL_SLOTS records with a sequence number, each write goes
+// to the next slot so a torn write only loses the newest record.
+#define PERSIST_JOURNAL_SLOTS 8
+#define PERSIST_RTC_PERIOD_MS 100
+// journal writes while an axis runs, and at most this often once stopped
+#define PERSIST_JOURNAL_PERIOD_S 10
+#define PERSIST_JOURNAL_MIN_S 1
+
+typedef enum {
+    PERSIST_NONE,
+    PERSIST_RTC,
+    PERSIST_JOURNAL,
+} persist_source_t;
+
+// after axis_init and before scheduler_start, so the first command already
+// sees the restored position
+persist_source_t persist_restore(void);
+// after scheduler_start, starts the task that keeps both copies up to date
+void persist_init(void);
+
+// with the axes suspended nothing moves, once the journal is current the task
+// sleeps until they resume or a command ends, which may have set a position
+void persist_suspend(bool suspend);
+void persist_command_end(void);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+// integer PID in the control ISR, the ESP32 FPU has no double precision
+#ifndef DC_MOTOR_FIXED_PID
+#define DC_MOTOR_FIXED_PID 1
+#endif
+
+#define PID_VALUE_SHIFT 16
+#define PID_GAIN_SHIFT 30
+
+#if DC_MOTOR_FIXED_PID
+// speeds and errors in counts, Q16; gains and pid output Q30
+typedef int32_t pid_value_t;
+typedef int32_t pid_gain_t;
+#define PID_VALUE_MAX (1 << 30)
+#define PID_VALUE(x) ((pid_value_t)((x) * (1 << PID_VALUE_SHIFT) + ((x) < 0 ? -0.5 : 0.5)))
+#define PID_GAIN(x) ((pid_gain_t)((x) * (1 << PID_GAIN_SHIFT) + ((x) < 0 ? -0.5 : 0.5)))
+#define PID_VALUE_TO_DOUBLE(x) ((double)(x) / (1 << PID_VALUE_SHIFT))
+#define PID_GAIN_TO_DOUBLE(x) ((double)(x) / (1 << PID_GAIN_SHIFT))
+#define PID_VALUE_TO_Q16(x) ((int32_t)(x))
+#define PID_VALUE_FROM_Q16(x) ((pid_value_t)(x))
+#else
+typedef double pid_value_t;
+typedef double pid_gain_t;
+#define PID_VALUE(x) ((double)(x))
+#define PID_GAIN(x) ((double)(x))
+#define PID_VALUE_TO_DOUBLE(x) (x)
+#define PID_GAIN_TO_DOUBLE(x) (x)
+#define PID_VALUE_TO_Q16(x) ((int32_t)((x) * 65536))
+#define PID_VALUE_FROM_Q16(x) ((double)(x) / 65536)
+#endif
+
+// one update of the velocity form PID from the last three errors, the output
+// is clamped to 0..1 of full duty. Both are built whatever DC_MOTOR_FIXED_PID
+// selects for the host equivalence check, see bench.h
+
+// Q16 errors, Q30 gains and output; the increment is rounded, truncating it
+// would drift the output by half an LSB every update
+static inline int32_t pid_update_fixed(int32_t output, int32_t e0, int32_t e1, int32_t e2,
+                                       int32_t Kp, int32_t Ki, int32_t Kd)
+{
+    int64_t out = output +
+                  (((int64_t)e0 * Ki +
+                    ((int64_t)e0 - e1) * Kp +
+                    ((int64_t)e0 - 2 * (int64_t)e1 + e2) * Kd +
+                    (1 << (PID_VALUE_SHIFT - 1))) >> PID_VALUE_SHIFT);
+    if (out < 0) out = 0;
+    if (out > (1 << PID_GAIN_SHIFT)) out = 1 << PID_GAIN_SHIFT;
+    return out;
+}
+
+static inline double pid_update_double(double output, double e0, double e1, double e2,
+                                       double Kp, double Ki, double Kd)
+{
+    output += e0 * Ki + (e0 - e1) * Kp + (e0 - 2 * e1 + e2) * Kd;
+    if (output < 0) output = 0;
+    if (output > 1) output = 1;
+    return output;
+}
@@ -0,0 +1,193 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#include "power.h"
+#include "axis.h"
+#include "telemetry.h"
+#include "st4.h"
+#include "stream.h"
+#include "persist.h"
+#include "scheduler.h"
+
+static SemaphoreHandle_t power_lock;
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpu_lock;       // ESP_PM_CPU_FREQ_MAX
+static esp_pm_lock_handle_t control_lock;   // ESP_PM_NO_LIGHT_SLEEP, while not suspended
+static esp_pm_lock_handle_t uart_lock;      // ESP_PM_NO_LIGHT_SLEEP
+#endif
+
+// owned under power_lock
+static int full_holders;        // commands in progress and a running goto
+static bool goto_running;
+static bool suspended;
+static bool uart_active;
+static int64_t busy_time;      // us, last time an axis was busy
+
+static power_state_t state;
+static int64_t since;
+static int64_t state_time[POWER_STATES];
+
+static void power_update_state(void)
+{
+    power_state_t next = suspended ? POWER_SUSPENDED : (full_holders ? POWER_FULL : POWER_SCALED);
+    if (next == state) return;
+
+    int64_t now = scheduler_get_time();
+    state_time[state] += now - since;
+    since = now;
+    state = next;
+}
+
+static void power_full(bool full)
+{
+#if CONFIG_PM_ENABLE
+    if (full) esp_pm_lock_acquire(cpu_lock);
+    else esp_pm_lock_release(cpu_lock);
+#endif
+    full_holders += full ? 1 : -1;
+    power_update_state();
+}
+
+static void power_suspend(bool suspend)
+{
+    if (suspend == suspended) return;
+
+    if (suspend) {
+        // the control task is running this, it sleeps until resumed
+        scheduler_suspend(true);
+        for (int i = 0; i < AXES; i++) axis_suspend(&axes[i], true);
+        persist_suspend(true);
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_release(control_lock);
+#endif
+    }
+    else {
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_acquire(control_lock);
+#endif
+        for (int i = 0; i < AXES; i++) axis_suspend(&axes[i], false);
+        persist_suspend(false);
+        scheduler_suspend(false);
+    }
+    suspended = suspend;
+    busy_time = scheduler_get_time();
+    power_update_state();
+}
+
+static bool power_axes_busy(bool *in_goto)
+{
+    bool busy = telemetry_get_enabled() || stream_get_enabled();
+    *in_goto = false;
+    for (int i = 0; i < AXES; i++) {
+        axis_t *a = &axes[i];
+        guide_t *guide = axis_get_guide(a);
+        if (axis_get_running(a)) {
+            busy = true;
+            if (axis_get_stop_at_target(a)) *in_goto = true;
+        }
+        if (guide_get_pulse_active(guide) || guide_get_direction(guide)) busy = true;
+    }
+    return busy;
+}
+
+// an ST-4 edge can't resume the control step from its interrupt
+#define POWER_ST4_USED ((ST4_RA_PLUS_GPIO >= 0) || (ST4_RA_MINUS_GPIO >= 0) || \
+                        (ST4_DEC_PLUS_GPIO >= 0) || (ST4_DEC_MINUS_GPIO >= 0))
+
+// control task, once per control step
+static void power_on_control_task(void *user_ctx)
+{
+    bool in_goto;
+    bool busy = power_axes_busy(&in_goto);
+
+    xSemaphoreTake(power_lock, portMAX_DELAY);
+    if (in_goto != goto_running) {
+        goto_running = in_goto;
+        power_full(in_goto);
+    }
+    // control task wakeups can coalesce, so the idle time is not counted in steps
+    int64_t now = scheduler_get_time();
+    if (busy) busy_time = now;
+    else if (POWER_LIGHT_SLEEP && !POWER_ST4_USED && (now - busy_time >= POWER_SLEEP_DELAY_S * 1000000LL)) power_suspend(true);
+    xSemaphoreGive(power_lock);
+}
+
+void power_init(void)
+{
+    power_lock = xSemaphoreCreateMutex();
+    state = POWER_SCALED;
+    since = scheduler_get_time();
+
+#if CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_full", &cpu_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "control", &control_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "uart", &uart_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_acquire(control_lock));
+
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = POWER_LIGHT_SLEEP,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+#endif
+
+    scheduler_add_task(power_on_control_task, NULL);
+}
+
+void power_command_begin(bool wake)
+{
+    xSemaphoreTake(power_lock, portMAX_DELAY);
+    power_full(true);
+    if (wake) power_suspend(false);
+    xSemaphoreGive(power_lock);
+}
+
+void power_command_end(void)
+{
+    xSemaphoreTake(power_lock, portMAX_DELAY);
+    power_full(false);
+    xSemaphoreGive(power_lock);
+    persist_command_end();
+}
+
+void power_uart_activity(void)
+{
+    if (uart_active) return;
+    uart_active = true;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(uart_lock);
+#endif
+}
+
+void power_uart_idle(void)
+{
+    if (!uart_active) return;
+    uart_active = false;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_release(uart_lock);
+#endif
+}
+
+int64_t power_get_time(power_state_t which)
+{
+    xSemaphoreTake(power_lock, portMAX_DELAY);
+    int64_t t = state_time[which];
+    if (which == state) t += scheduler_get_time() - since;
+    xSemaphoreGive(power_lock);
+    return t;
+}
+
+void power_reset_time(void)
+{
+    xSemaphoreTake(power_lock, portMAX_DELAY);
+    memset(state_time, 0, sizeof(state_time));
+    since = scheduler_get_time();
+    xSemaphoreGive(power_lock);
+}
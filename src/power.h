@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// battery operation: with CONFIG_PM_ENABLE the CPU clock scales down to
+// POWER_MIN_FREQ_MHZ and is only raised to the maximum while a goto runs or a
+// command is handled. The APB clock of the MCPWM, PCNT and timer peripherals
+// stays at 80 MHz, so the control step keeps its timing. Once all axes have
+// been idle for POWER_SLEEP_DELAY_S the control step and the motor peripherals
+// are suspended, which releases their PM locks and allows automatic light
+// sleep (with CONFIG_FREERTOS_USE_TICKLESS_IDLE); a command changing the
+// motion resumes them. Inquiries are answered from the last snapshot. With
+// ST-4 inputs configured the control step is never suspended.
+#ifndef POWER_MIN_FREQ_MHZ
+#define POWER_MIN_FREQ_MHZ 80
+#endif
+#ifndef POWER_LIGHT_SLEEP
+#define POWER_LIGHT_SLEEP 1
+#endif
+#ifndef POWER_SLEEP_DELAY_S
+#define POWER_SLEEP_DELAY_S 10
+#endif
+// light sleep loses UART input, it is held off this long after UART activity
+#define POWER_UART_HOLD_MS 2000
+
+typedef enum {
+    POWER_FULL,       // maximum CPU clock
+    POWER_SCALED,     // control step running, CPU clock free to scale down
+    POWER_SUSPENDED,  // control step suspended, light sleep allowed
+    POWER_STATES,
+} power_state_t;
+
+// before scheduler_start
+void power_init(void);
+
+// around a command, wake also resumes the control step
+void power_command_begin(bool wake);
+void power_command_end(void);
+
+// UART events, idle after POWER_UART_HOLD_MS without one
+void power_uart_activity(void);
+void power_uart_idle(void);
+
+// microseconds spent in a state since the last reset
+int64_t power_get_time(power_state_t state);
+void power_reset_time(void);
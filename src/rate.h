@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// exact constant rate for the control ISR: counts every interval_us, handed
+// out per control period as Q16 setpoints whose sum never drifts from the
+// rate. The integer part of the setpoint is fixed, the remainder is carried
+// Bresenham style and adds 1/65536 count whenever it wraps.
+typedef struct {
+    int32_t step;             // counts per period, Q16, rounded down
+    uint64_t rem;             // per period, in 1/den of the last Q16 bit
+    uint64_t den;
+    uint64_t acc;
+} rate_t;
+
+// task context, prepared for the ISR to take over
+static inline void rate_set(rate_t *rate, uint32_t counts, uint32_t interval_us)
+{
+    // counts * 1e6 / (interval_us * CONTROL_RATE_HZ) per period, Q16
+    uint64_t num = ((uint64_t)counts * 1000000) << 16;
+    uint64_t den = (uint64_t)(interval_us ? interval_us : 1) * CONTROL_RATE_HZ;
+    rate->step = interval_us ? num / den : 0;
+    rate->rem = interval_us ? num % den : 0;
+    rate->den = den;
+    rate->acc = 0;
+}
+
+// whether the setpoint of counts every interval_us fits the Q16 step, 0 stops
+static inline bool rate_fits(uint32_t counts, uint32_t interval_us)
+{
+    if (!interval_us) return true;
+    return (((uint64_t)counts * 1000000) << 16) / ((uint64_t)interval_us * CONTROL_RATE_HZ) <= INT32_MAX;
+}
+
+// control ISR, setpoint of the next period, Q16
+static inline int32_t rate_next(rate_t *rate)
+{
+    int32_t out = rate->step;
+    rate->acc += rate->rem;
+    if (rate->acc >= rate->den) {
+        rate->acc -= rate->den;
+        out++;
+    }
+    return out;
+}
@@ -0,0 +1,334 @@
+#include "sdkconfig.h"
+#include "replay.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+void replay_init(void)
+{
+}
+
+void replay_run(void)
+{
+}
+
+void replay_record(char dir, const char *buf, int len)
+{
+}
+
+#else
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "axis.h"
+#include "sw_protocol.h"
+#include "scheduler.h"
+#include "timing.h"
+
+#define REPLAY_LINE_MAX 1024
+#define REPLAY_REPORT_MISMATCHES 10
+
+typedef struct {
+    int64_t time;             // us since the start of the session
+    char dir;
+    int len;
+    char *data;
+} replay_entry_t;
+
+// one expected reply, up to and including its CR
+typedef struct {
+    const char *data;
+    const char *wild;         // 1 where a hex digit may differ
+    int len;
+} replay_reply_t;
+
+typedef struct {
+    uint32_t *ns;
+    int count;
+    int size;
+} replay_samples_t;
+
+static FILE *record_file;
+static int64_t record_start;
+static bool record_checked;
+
+static replay_entry_t *entries;
+static int entry_count;
+
+static axis_stub_t stubs[AXES];
+static bool stubbed;
+
+static int64_t wall_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *grow(void *p, int *size, int count, size_t item)
+{
+    if (count < *size) return p;
+    *size = *size ? *size * 2 : 64;
+    p = realloc(p, *size * item);
+    if (!p) abort();
+    return p;
+}
+
+static void write_escaped(FILE *f, const char *buf, int len)
+{
+    for (int i = 0; i < len; i++) {
+        unsigned char c = buf[i];
+        if (c == '\r') fputs("\\r", f);
+        else if (c == '\n') fputs("\\n", f);
+        else if (c == '\\') fputs("\\\\", f);
+        else if ((c < 0x20) || (c >= 0x7F)) fprintf(f, "\\x%02X", c);
+        else fputc(c, f);
+    }
+}
+
+// in place, returns the decoded length
+static int unescape(char *s)
+{
+    char *in = s;
+    char *out = s;
+    while (*in) {
+        if (*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+        in++;
+        if (*in == 'r') *out++ = '\r';
+        else if (*in == 'n') *out++ = '\n';
+        else if ((*in == 'x') && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+            char hex[3] = { in[1], in[2], 0 };
+            *out++ = strtol(hex, NULL, 16);
+            in += 2;
+        }
+        else if (*in) *out++ = *in;
+        else break;
+        in++;
+    }
+    return out - s;
+}
+
+void replay_record(char dir, const char *buf, int len)
+{
+    if (!record_checked) {
+        record_checked = true;
+        const char *path = getenv("SA_RECORD");
+        if (path) record_file = fopen(path, "w");
+        record_start = scheduler_get_time();
+    }
+    if (!record_file || (len <= 0)) return;
+
+    fprintf(record_file, "%lld %c ", (long long)(scheduler_get_time() - record_start), dir);
+    write_escaped(record_file, buf, len);
+    fputc('\n', record_file);
+    fflush(record_file);
+}
+
+void replay_init(void)
+{
+    const char *env = getenv("SA_REPLAY_STUB");
+    stubbed = env && atoi(env);
+    if (!stubbed) return;
+    for (int i = 0; i < AXES; i++) {
+        axes[i].type = AXIS_STUB;
+        axes[i].stub = &stubs[i];
+    }
+}
+
+static bool replay_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "replay: can't open %s\n", path);
+        return false;
+    }
+
+    char line[REPLAY_LINE_MAX];
+    int size = 0;
+    int line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = 0;
+        if ((line[0] == 0) || (line[0] == '#')) continue;
+
+        long long time;
+        char dir;
+        int data_start;
+        if ((sscanf(line, "%lld %c %n", &time, &dir, &data_start) < 2) || !strchr("><~", dir)) {
+            fprintf(stderr, "replay: %s:%d: bad record\n", path, line_no);
+            fclose(f);
+            return false;
+        }
+
+        entries = grow(entries, &size, entry_count, sizeof(replay_entry_t));
+        replay_entry_t *e = &entries[entry_count++];
+        e->time = time;
+        e->dir = dir;
+        e->data = strdup(line + data_start);
+        e->len = unescape(e->data);
+    }
+    fclose(f);
+    return true;
+}
+
+// the recorded replies, split at CR since a capture may cut them anywhere
+static int replay_expected(replay_reply_t **replies)
+{
+    int total = 0;
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].dir != '>') total += entries[i].len;
+    }
+    char *data = malloc(total + 1);
+    char *wild = malloc(total + 1);
+
+    int pos = 0;
+    for (int i = 0; i < entry_count; i++) {
+        replay_entry_t *e = &entries[i];
+        if (e->dir == '>') continue;
+        memcpy(data + pos, e->data, e->len);
+        memset(wild + pos, e->dir == '~', e->len);
+        pos += e->len;
+    }
+
+    int count = 0;
+    int size = 0;
+    *replies = NULL;
+    for (int start = 0; start < total; ) {
+        int end = start;
+        while ((end < total) && (data[end] != '\r')) end++;
+        if (end < total) end++;
+        *replies = grow(*replies, &size, count, sizeof(replay_reply_t));
+        (*replies)[count++] = (replay_reply_t){ data + start, wild + start, end - start };
+        start = end;
+    }
+    return count;
+}
+
+static bool replay_match(const replay_reply_t *expected, const char *resp, int len)
+{
+    if (expected->len != len) return false;
+    for (int i = 0; i < len; i++) {
+        if (expected->wild[i] && isxdigit((unsigned char)expected->data[i]) && isxdigit((unsigned char)resp[i])) continue;
+        if (expected->data[i] != resp[i]) return false;
+    }
+    return true;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const replay_samples_t *s, int p)
+{
+    return s->ns[(s->count - 1) * p / 100] / 1000.0;
+}
+
+static void replay_report(replay_samples_t *samples, int commands, int64_t elapsed_us, int64_t handling_ns)
+{
+    fprintf(stderr, "\nopcode  count   p50 us   p90 us   p99 us   max us\n");
+    for (int op = 0; op < 128; op++) {
+        replay_samples_t *s = &samples[op];
+        if (!s->count) continue;
+        qsort(s->ns, s->count, sizeof(uint32_t), compare_ns);
+        fprintf(stderr, "  %c   %7d %8.1f %8.1f %8.1f %8.1f\n", op, s->count,
+                percentile_us(s, 50), percentile_us(s, 90), percentile_us(s, 99), percentile_us(s, 100));
+    }
+    fprintf(stderr, "%d commands in %.3f s, %.0f commands/s, %.0f commands/s handling only\n", commands,
+            elapsed_us / 1e6, elapsed_us ? commands * 1e6 / elapsed_us : 0.0,
+            handling_ns ? commands * 1e9 / handling_ns : 0.0);
+}
+
+void replay_run(void)
+{
+    const char *path = getenv("SA_REPLAY");
+    if (!path) return;
+    if (!replay_load(path)) exit(2);
+
+    const char *env = getenv("SA_REPLAY_FLAT");
+    bool flat = env && atoi(env);
+    env = getenv("SA_REPLAY_REPEAT");
+    int repeat = env ? atoi(env) : 1;
+    if (repeat < 1) repeat = 1;
+
+    replay_reply_t *expected;
+    int expected_count = replay_expected(&expected);
+
+    static replay_samples_t samples[128];
+    sw_parser_t parser = { .source = SW_SOURCE_UART };
+    char resp[SW_RESP_MAX];
+    char command[32];
+    int command_len = 0;
+    int commands = 0;
+    int mismatched = 0;
+    int64_t handling_ns = 0;
+    int64_t start_us = wall_us();
+
+    for (int pass = 0; pass < repeat; pass++) {
+        int64_t t0 = scheduler_get_time();
+        int reply = 0;
+        if (stubbed) {
+            for (int i = 0; i < AXES; i++) {
+                axis_init(&axes[i]);
+                axes[i].fast = false;
+            }
+        }
+
+        for (int i = 0; i < entry_count; i++) {
+            replay_entry_t *e = &entries[i];
+            if (e->dir != '>') continue;
+            while (!flat && (scheduler_get_time() - t0 < e->time)) vTaskDelay(1);
+
+            for (int j = 0; j < e->len; j++) {
+                char ch = e->data[j];
+                if (ch == ':') command_len = 0;
+                if (command_len < (int)sizeof(command) - 1) command[command_len++] = ch;
+
+                uint32_t start = timing_cycles();
+                int len = sw_parser_feed(&parser, ch, resp);
+                uint32_t ns = timing_cycles() - start;
+                if (!len) continue;
+
+                replay_samples_t *s = &samples[parser.opcode & 0x7F];
+                s->ns = grow(s->ns, &s->size, s->count, sizeof(uint32_t));
+                s->ns[s->count++] = ns;
+                handling_ns += ns;
+                commands++;
+
+                bool ok = (reply < expected_count) && replay_match(&expected[reply], resp, len);
+                if (!ok && (++mismatched <= REPLAY_REPORT_MISMATCHES)) {
+                    fprintf(stderr, "replay: pass %d reply %d to ", pass + 1, reply + 1);
+                    write_escaped(stderr, command, command_len);
+                    fputs(": expected ", stderr);
+                    if (reply < expected_count) write_escaped(stderr, expected[reply].data, expected[reply].len);
+                    else fputs("nothing", stderr);
+                    fputs(", got ", stderr);
+                    write_escaped(stderr, resp, len);
+                    fputc('\n', stderr);
+                }
+                reply++;
+            }
+        }
+        if (reply < expected_count) {
+            mismatched += expected_count - reply;
+            fprintf(stderr, "replay: pass %d ended %d replies short\n", pass + 1, expected_count - reply);
+        }
+    }
+
+    replay_report(samples, commands, wall_us() - start_us, handling_ns);
+    fprintf(stderr, "%d of %d replies differ\n", mismatched, commands);
+    exit(mismatched ? 1 : 0);
+}
+
+#endif
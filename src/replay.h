@@ -0,0 +1,30 @@
+#pragma once
+
+// host build only: record an EQMOD session and replay it against the firmware
+// as a regression and latency check.
+//
+// SA_RECORD=<file> logs what arrives on stdin and the replies. SA_REPLAY=<file>
+// runs a capture instead of reading stdin: commands are sent at their
+// recorded time in simulated time (so SA_SIM_SPEEDUP applies), or back to
+// back with SA_REPLAY_FLAT=1, SA_REPLAY_REPEAT=N runs it N times. The
+// replies are compared with the recorded ones, then per-opcode handling
+// latency percentiles and the command rate go to stderr and the process
+// exits with 0 if all replies matched, 1 if not, 2 if the capture is unusable.
+// SA_REPLAY_STUB=1 puts stub axes (axis.h) in place of the motors, reset
+// before every pass, so the replies do not depend on timing and a capture
+// taken that way matches byte for byte.
+//
+// capture, one record per line, '#' starts a comment:
+//   <microseconds since the start> <dir> <bytes>
+// dir '>' host to mount, '<' reply compared byte for byte, '~' reply whose
+// hex digits may differ (positions, anything moving). Bytes are escaped as
+// \r, \n, \\ and \xHH. Replies may be split over several records.
+
+// before the axes are initialized
+void replay_init(void);
+
+// from the comms task, returns at once unless SA_REPLAY is set
+void replay_run(void);
+
+// UART traffic while SA_RECORD is set, dir '>' or '<'
+void replay_record(char dir, const char *buf, int len);
@@ -0,0 +1,192 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "scheduler.h"
+#include "timing.h"
+
+typedef struct {
+    scheduler_fn_t fn;
+    void *user_ctx;
+} scheduler_entry_t;
+
+typedef struct {
+    scheduler_task_fn_t fn;
+    void *user_ctx;
+} scheduler_task_entry_t;
+
+static DRAM_ATTR scheduler_entry_t entries[SCHEDULER_MAX_ENTRIES];
+static DRAM_ATTR int entry_count = 0;
+
+static scheduler_task_entry_t task_entries[SCHEDULER_MAX_TASK_ENTRIES];
+static int task_entry_count = 0;
+static DRAM_ATTR TaskHandle_t control_task_handle;
+
+void scheduler_add(scheduler_fn_t fn, void *user_ctx)
+{
+    assert(entry_count < SCHEDULER_MAX_ENTRIES);
+    entries[entry_count].fn = fn;
+    entries[entry_count].user_ctx = user_ctx;
+    entry_count++;
+}
+
+void scheduler_add_task(scheduler_task_fn_t fn, void *user_ctx)
+{
+    assert(task_entry_count < SCHEDULER_MAX_TASK_ENTRIES);
+    task_entries[task_entry_count].fn = fn;
+    task_entries[task_entry_count].user_ctx = user_ctx;
+    task_entry_count++;
+}
+
+static bool IRAM_ATTR scheduler_run(void)
+{
+    uint32_t start = timing_cycles();
+    bool high_task_wakeup = false;
+    for (int i = 0; i < entry_count; i++) {
+        high_task_wakeup |= entries[i].fn(entries[i].user_ctx);
+    }
+    timing_record(TIMING_ISR_DURATION, timing_cycles() - start);
+    return high_task_wakeup;
+}
+
+// sleeps until the next control step, missed steps are not made up
+static void control_task(void *pvParameters)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int i = 0; i < task_entry_count; i++) {
+            task_entries[i].fn(task_entries[i].user_ctx);
+        }
+    }
+}
+
+static void control_task_start(void)
+{
+    xTaskCreatePinnedToCore(control_task, "control", 4096, NULL, CONTROL_TASK_PRIORITY, &control_task_handle, CONTROL_CORE);
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+
+static int64_t sim_time_us = 0;
+static bool suspended;
+
+// SA_SIM_SPEEDUP=0 runs the simulation as fast as possible, N runs it N times faster than real time
+static void sim_task(void *pvParameters)
+{
+    const char *env = getenv("SA_SIM_SPEEDUP");
+    int speedup = env ? atoi(env) : 1;
+    int64_t start_us = sim_time_us;
+    TickType_t start_tick = xTaskGetTickCount();
+    int batch = 0;
+
+    while (1) {
+        // the simulated plants catch up with the new time in their control step
+        sim_time_us += CONTROL_PERIOD_US;
+        if (!__atomic_load_n(&suspended, __ATOMIC_ACQUIRE)) {
+            scheduler_run();
+            xTaskNotifyGive(control_task_handle);
+            taskYIELD();
+        }
+
+        if (speedup > 0) {
+            TickType_t due = start_tick + pdMS_TO_TICKS((sim_time_us - start_us) / 1000 / speedup);
+            TickType_t now = xTaskGetTickCount();
+            if ((int32_t)(due - now) > 0) vTaskDelay(due - now);
+        }
+        else if (++batch == 1000) {
+            batch = 0;
+            vTaskDelay(1);
+        }
+    }
+}
+
+void scheduler_start(void)
+{
+    control_task_start();
+    xTaskCreate(sim_task, "sim", 4096, NULL, configMAX_PRIORITIES - 1, NULL);
+}
+
+void scheduler_suspend(bool suspend)
+{
+    __atomic_store_n(&suspended, suspend, __ATOMIC_RELEASE);
+}
+
+int64_t scheduler_get_time(void)
+{
+    return sim_time_us;
+}
+
+#else
+
+#include "driver/gptimer.h"
+#include "esp_timer.h"
+
+// fine enough to see the interrupt latency
+#define SCHEDULER_TIMER_HZ 10000000
+#define SCHEDULER_TICKS_PER_US (SCHEDULER_TIMER_HZ / 1000000)
+
+static DRAM_ATTR uint32_t cycles_per_us;
+static gptimer_handle_t timer;
+
+static bool IRAM_ATTR scheduler_on_alarm(gptimer_handle_t gptimer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+    // the counter restarted from 0 on the alarm
+    uint64_t count;
+    gptimer_get_raw_count(gptimer, &count);
+    timing_record(TIMING_ISR_LATENCY, (uint32_t)count * cycles_per_us / SCHEDULER_TICKS_PER_US);
+
+    BaseType_t high_task_wakeup = scheduler_run();
+    vTaskNotifyGiveFromISR(control_task_handle, &high_task_wakeup);
+    return high_task_wakeup;
+}
+
+void scheduler_start(void)
+{
+    cycles_per_us = timing_cycles_per_us();
+    control_task_start();
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = SCHEDULER_TIMER_HZ,
+        .intr_priority = CONTROL_INTR_PRIORITY,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &timer));
+
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = scheduler_on_alarm,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(timer, &callbacks, NULL));
+
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = CONTROL_PERIOD_US * SCHEDULER_TICKS_PER_US,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(timer, &alarm_config));
+    ESP_ERROR_CHECK(gptimer_enable(timer));
+    ESP_ERROR_CHECK(gptimer_start(timer));
+}
+
+void scheduler_suspend(bool suspend)
+{
+    // the count continues from where it stopped
+    if (suspend) {
+        ESP_ERROR_CHECK(gptimer_stop(timer));
+        ESP_ERROR_CHECK(gptimer_disable(timer));
+    }
+    else {
+        ESP_ERROR_CHECK(gptimer_enable(timer));
+        ESP_ERROR_CHECK(gptimer_start(timer));
+    }
+}
+
+int64_t IRAM_ATTR scheduler_get_time(void)
+{
+    return esp_timer_get_time();
+}
+
+#endif
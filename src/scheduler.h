@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+#ifndef CONTROL_RATE_HZ
+#define CONTROL_RATE_HZ 200
+#endif
+#define CONTROL_PERIOD_US (1000000 / CONTROL_RATE_HZ)
+
+// one timer event every CONTROL_PERIOD_US runs the control step of all axes,
+// in the order they were added, from interrupt context
+#define SCHEDULER_MAX_ENTRIES 4
+
+// returns true when a higher priority task was woken
+typedef bool (*scheduler_fn_t)(void *user_ctx);
+
+// called by the HALs from their init, before scheduler_start
+void scheduler_add(scheduler_fn_t fn, void *user_ctx);
+
+// the control core takes the scheduler timer, the motor interrupts and the
+// control task, the other one WiFi, the UART and everything else that waits
+// for I/O; the host build has a single core for both
+#define CONTROL_CORE (portNUM_PROCESSORS - 1)
+// the scheduler timer and the counter interrupts of the motors, all on
+// CONTROL_CORE at one level, so none of them preempts another and their
+// handlers may share the control state
+#define CONTROL_INTR_PRIORITY 1
+#define COMMS_CORE 0
+#define CONTROL_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#define COMMS_TASK_PRIORITY 5
+
+// work that is not ISR safe, run by the control task after each control step
+// in the order it was added; it may block for a tick, not for a period
+#define SCHEDULER_MAX_TASK_ENTRIES 4
+
+typedef void (*scheduler_task_fn_t)(void *user_ctx);
+
+// before scheduler_start
+void scheduler_add_task(scheduler_task_fn_t fn, void *user_ctx);
+// from a task on CONTROL_CORE, the interrupts are allocated on the calling core
+void scheduler_start(void);
+// stops the timer and with it the control step and the control task, its PM
+// lock no longer keeps the chip out of light sleep
+void scheduler_suspend(bool suspend);
+
+// microseconds, esp_timer time base; on the host simulated time,
+// advanced by one control period per event
+int64_t scheduler_get_time(void);
@@ -0,0 +1,76 @@
+#include "sdkconfig.h"
+#include "st4.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+
+void st4_init(void)
+{
+}
+
+#else
+
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
+#include "axis.h"
+
+typedef struct {
+    int plus_gpio;
+    int minus_gpio;
+    guide_t *guide;
+} st4_input_t;
+
+static DRAM_ATTR st4_input_t st4_inputs[AXES];
+
+static int IRAM_ATTR st4_active(int gpio)
+{
+    return (gpio >= 0) && !gpio_get_level((gpio_num_t)gpio);
+}
+
+// any edge on either pin of an axis, the direction is taken from both levels
+// with the edge time, so the correction starts and ends with the input
+static void IRAM_ATTR st4_isr(void *arg)
+{
+    st4_input_t *input = (st4_input_t *)arg;
+    int64_t time = esp_timer_get_time();
+    int32_t direction = st4_active(input->plus_gpio) - st4_active(input->minus_gpio);
+    guide_set_direction(input->guide, direction, time);
+}
+
+static void st4_add_pin(int gpio, st4_input_t *input)
+{
+    if (gpio < 0) return;
+
+    gpio_config_t io_config = {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&io_config));
+    ESP_ERROR_CHECK(gpio_isr_handler_add((gpio_num_t)gpio, st4_isr, input));
+}
+
+void st4_init(void)
+{
+    const int pins[AXES][2] = {
+        { ST4_RA_PLUS_GPIO, ST4_RA_MINUS_GPIO },
+        { ST4_DEC_PLUS_GPIO, ST4_DEC_MINUS_GPIO },
+    };
+
+    // normally installed by the encoder already
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(err);
+
+    for (int i = 0; i < AXES; i++) {
+        st4_input_t *input = &st4_inputs[i];
+        input->plus_gpio = pins[i][0];
+        input->minus_gpio = pins[i][1];
+        input->guide = axis_get_guide(&axes[i]);
+        st4_add_pin(input->plus_gpio, input);
+        st4_add_pin(input->minus_gpio, input);
+    }
+}
+
+#endif
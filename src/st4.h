@@ -0,0 +1,19 @@
+#pragma once
+
+// ST-4 autoguider port, four active low inputs, the pins are set in build_flags
+// and -1 leaves an input unused
+#ifndef ST4_RA_PLUS_GPIO
+#define ST4_RA_PLUS_GPIO -1
+#endif
+#ifndef ST4_RA_MINUS_GPIO
+#define ST4_RA_MINUS_GPIO -1
+#endif
+#ifndef ST4_DEC_PLUS_GPIO
+#define ST4_DEC_PLUS_GPIO -1
+#endif
+#ifndef ST4_DEC_MINUS_GPIO
+#define ST4_DEC_MINUS_GPIO -1
+#endif
+
+// after axis_init, the guide rate is the one set by :P
+void st4_init(void);
@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "stepper.h"
+
+static void IRAM_ATTR stepper_on_overflow(int32_t value, void *user_ctx)
+{
+    stepper_context_t *stepper_context = (stepper_context_t *)user_ctx;
+    stepper_context->accumu_count += value;
+}
+
+static void IRAM_ATTR stepper_apply_mailbox(stepper_context_t *stepper_context)
+{
+    uint32_t tail = stepper_context->mailbox_tail;
+    uint32_t head = __atomic_load_n(&stepper_context->mailbox_head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        const stepper_cmd_t *cmd = &stepper_context->mailbox[tail % STEPPER_MAILBOX_SIZE];
+        switch (cmd->type) {
+            case STEPPER_CMD_START:
+                stepper_context->run = stepper_context->next_run;
+                stepper_context->lag = 0;
+                stepper_context->running = true;
+                stepper_context->stopping = false;
+                break;
+            case STEPPER_CMD_STOP:
+                if (cmd->instant) stepper_context->running = false;
+                stepper_context->stopping = true;
+                break;
+            case STEPPER_CMD_SET_POSITION:
+                stepper_context->accumu_count += cmd->position - stepper_context->position;
+                stepper_context->position = cmd->position;
+                break;
+            case STEPPER_CMD_SET_RATE:
+                stepper_context->rate = cmd->rate;
+                break;
+        }
+        tail++;
+    }
+    __atomic_store_n(&stepper_context->mailbox_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void IRAM_ATTR stepper_publish(stepper_context_t *stepper_context)
+{
+    uint32_t seq = stepper_context->snapshot_seq;
+    __atomic_store_n(&stepper_context->snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stepper_context->snapshot.position = stepper_context->position;
+    stepper_context->snapshot.target_speed = stepper_context->rate.step;
+    stepper_context->snapshot.running = stepper_context->running;
+
+    __atomic_store_n(&stepper_context->snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int32_t IRAM_ATTR stepper_next_speed(stepper_context_t *stepper_context)
+{
+    int32_t speed = stepper_context->speed;
+    int32_t accel = stepper_context->accel;
+
+    if (stepper_context->stopping) {
+        return (speed > accel) ? speed - accel : 0;
+    }
+    if (stepper_context->run.stop_at_target) {
+        return PID_VALUE_TO_Q16(motion_profile_next(&stepper_context->run.profile));
+    }
+    // tracking, ramp to a new rate without losing steps, then follow it
+    // exactly; rates above the slew speed are held at it
+    int32_t target = stepper_context->rate.step;
+    if (target > stepper_context->max_rate) target = stepper_context->max_rate;
+    if (target - speed > accel) return speed + accel;
+    if (speed - target > accel) return speed - accel;
+    if (target < stepper_context->rate.step) return target;
+    return rate_next(&stepper_context->rate);
+}
+
+// rate and lag in the run direction, negative steps back
+static void IRAM_ATTR stepper_output(stepper_context_t *stepper_context, int64_t rate)
+{
+    int64_t lag = stepper_context->lag;
+    bool reverse = stepper_context->run.direction;
+    if (rate < 0) {
+        rate = -rate;
+        lag = -lag;
+        reverse = !reverse;
+    }
+    // guide corrections and the lag on top of the slew speed
+    if (rate > stepper_context->max_rate) rate = stepper_context->max_rate;
+
+    if (reverse != stepper_context->reverse) {
+        // DIR changes one period after the pulses stopped
+        if (stepper_context->hal.period != 0) {
+            stepper_hal_set_period(&stepper_context->hal, 0);
+            return;
+        }
+        stepper_hal_set_direction(&stepper_context->hal, reverse);
+        stepper_context->reverse = reverse;
+    }
+
+    if (rate * CONTROL_RATE_HZ >= ((int64_t)STEPPER_RATE_MIN << 16)) {
+        int64_t period = ((int64_t)STEPPER_HAL_RESOLUTION_HZ << 16) / (rate * CONTROL_RATE_HZ);
+        stepper_hal_set_period(&stepper_context->hal, (period < STEPPER_HAL_PERIOD_MIN) ? STEPPER_HAL_PERIOD_MIN : period);
+    }
+    else {
+        stepper_hal_set_period(&stepper_context->hal, 0);
+        // counted in the next period
+        if (lag >= (1 << 16)) stepper_hal_step(&stepper_context->hal);
+    }
+}
+
+static bool IRAM_ATTR stepper_on_control(void *user_ctx)
+{
+    stepper_context_t *stepper_context = (stepper_context_t *)user_ctx;
+    bool was_running = stepper_context->running;
+
+    int32_t position = stepper_context->accumu_count + stepper_hal_get_count(&stepper_context->hal);
+    int32_t moved = position - stepper_context->position;
+    stepper_context->position = position;
+
+    int32_t guide = guide_take(&stepper_context->guide, scheduler_get_time());
+
+    stepper_apply_mailbox(stepper_context);
+    if (stepper_context->run.direction) {
+        moved = -moved;
+        guide = -guide;
+    }
+
+    int32_t to_go = 0;
+    if (stepper_context->running && stepper_context->run.stop_at_target) {
+        to_go = stepper_context->run.target - stepper_context->position;
+        if (stepper_context->run.direction) to_go = -to_go;
+        if (to_go <= 0) stepper_context->running = false;
+        // no guiding during a goto
+        guide = 0;
+    }
+
+    if (stepper_context->running) {
+        stepper_context->speed = stepper_next_speed(stepper_context);
+        if (stepper_context->stopping && (stepper_context->speed == 0)) stepper_context->running = false;
+    }
+
+    if (was_running && !stepper_context->running) {
+        // the run is over, guiding continues from where it stopped
+        stepper_context->speed = 0;
+        stepper_context->lag = 0;
+    }
+    else {
+        stepper_context->lag += stepper_context->speed + guide - ((int64_t)moved << 16);
+    }
+
+    // steps per period, Q16
+    int64_t rate = stepper_context->speed + guide + stepper_context->lag / STEPPER_CATCHUP_PERIODS;
+    if (stepper_context->running && stepper_context->run.stop_at_target && (rate > ((int64_t)to_go << 16))) {
+        rate = (int64_t)to_go << 16;
+    }
+    stepper_output(stepper_context, rate);
+
+    stepper_publish(stepper_context);
+    return false;
+}
+
+
+static void stepper_post(stepper_context_t *stepper_context, const stepper_cmd_t *cmd)
+{
+    xSemaphoreTake(stepper_context->post_lock, portMAX_DELAY);
+    uint32_t head = stepper_context->mailbox_head;
+    while (head - __atomic_load_n(&stepper_context->mailbox_tail, __ATOMIC_ACQUIRE) >= STEPPER_MAILBOX_SIZE) {
+        vTaskDelay(1);
+    }
+    stepper_context->mailbox[head % STEPPER_MAILBOX_SIZE] = *cmd;
+    __atomic_store_n(&stepper_context->mailbox_head, head + 1, __ATOMIC_RELEASE);
+    xSemaphoreGive(stepper_context->post_lock);
+}
+
+// wait until the control ISR took all posted commands, at most one period
+static void stepper_sync(stepper_context_t *stepper_context)
+{
+    while (__atomic_load_n(&stepper_context->mailbox_tail, __ATOMIC_ACQUIRE) != stepper_context->mailbox_head) {
+        vTaskDelay(1);
+    }
+}
+
+void stepper_init(stepper_context_t *stepper_context)
+{
+    stepper_context->post_lock = xSemaphoreCreateMutex();
+    rate_set(&stepper_context->rate, stepper_context->rate_counts, stepper_context->rate_interval_us);
+    stepper_context->accel = PID_VALUE_TO_Q16(PID_VALUE(stepper_context->slew_accel / ((double)CONTROL_RATE_HZ * CONTROL_RATE_HZ)));
+    stepper_context->max_rate = PID_VALUE_TO_Q16(PID_VALUE(stepper_context->slew_speed / CONTROL_RATE_HZ));
+
+    stepper_hal_callbacks_t cbs = {
+        .on_control = stepper_on_control,
+        .on_overflow = stepper_on_overflow,
+    };
+    guide_init(&stepper_context->guide);
+    stepper_hal_init(&stepper_context->hal, &cbs, stepper_context);
+    // holding torque, the axis must not move while the other one slews
+    stepper_hal_enable(&stepper_context->hal, true);
+}
+
+void stepper_start(stepper_context_t *stepper_context)
+{
+    stepper_snapshot_t snapshot;
+    // also makes sure the ISR is done with next_run
+    stepper_get_snapshot(stepper_context, &snapshot);
+
+    stepper_run_t *run = &stepper_context->next_run;
+    // a goto profile starts from standstill and a reversal would keep the
+    // speed in the other direction, ramp the running axis down first
+    if (snapshot.running && (stepper_context->stop_at_target || (stepper_context->direction != run->direction))) {
+        stepper_stop(stepper_context, false);
+        do {
+            vTaskDelay(1);
+            stepper_get_snapshot(stepper_context, &snapshot);
+        } while (snapshot.running);
+    }
+
+    run->stop_at_target = stepper_context->stop_at_target;
+    run->target = stepper_context->target;
+    if (run->stop_at_target) {
+        int32_t distance = run->target - snapshot.position;
+        stepper_context->direction = distance < 0;
+        motion_profile_plan(&run->profile, abs(distance),
+                            stepper_context->slew_speed / CONTROL_RATE_HZ,
+                            stepper_context->slew_accel / ((double)CONTROL_RATE_HZ * CONTROL_RATE_HZ));
+    }
+    run->direction = stepper_context->direction;
+
+    stepper_cmd_t cmd = { .type = STEPPER_CMD_START };
+    stepper_post(stepper_context, &cmd);
+}
+
+void stepper_stop(stepper_context_t *stepper_context, bool instant)
+{
+    stepper_cmd_t cmd = {
+        .type = STEPPER_CMD_STOP,
+        .instant = instant,
+    };
+    stepper_post(stepper_context, &cmd);
+}
+
+void stepper_suspend(stepper_context_t *stepper_context, bool suspend)
+{
+    stepper_hal_suspend(&stepper_context->hal, suspend);
+}
+
+void stepper_set_direction(stepper_context_t *stepper_context, bool direction)
+{
+    stepper_context->direction = direction;
+}
+
+void stepper_set_stop_at_target(stepper_context_t *stepper_context, bool stop_at_target)
+{
+    stepper_context->stop_at_target = stop_at_target;
+}
+
+void stepper_set_init(stepper_context_t *stepper_context, bool init)
+{
+    stepper_context->init = init;
+}
+
+void stepper_set_position(stepper_context_t *stepper_context, int32_t position)
+{
+    stepper_cmd_t cmd = {
+        .type = STEPPER_CMD_SET_POSITION,
+        .position = position,
+    };
+    stepper_post(stepper_context, &cmd);
+}
+
+void stepper_set_rate(stepper_context_t *stepper_context, uint32_t counts, uint32_t interval_us)
+{
+    stepper_context->rate_counts = counts;
+    stepper_context->rate_interval_us = interval_us;
+
+    stepper_cmd_t cmd = { .type = STEPPER_CMD_SET_RATE };
+    rate_set(&cmd.rate, counts, interval_us);
+    stepper_post(stepper_context, &cmd);
+}
+
+void stepper_set_target(stepper_context_t *stepper_context, int32_t target)
+{
+    stepper_context->target = target;
+}
+
+bool stepper_get_direction(stepper_context_t *stepper_context)
+{
+    return stepper_context->direction;
+}
+
+bool stepper_get_running(stepper_context_t *stepper_context)
+{
+    stepper_snapshot_t snapshot;
+    stepper_get_snapshot(stepper_context, &snapshot);
+    return snapshot.running;
+}
+
+bool stepper_get_stop_at_target(stepper_context_t *stepper_context)
+{
+    return stepper_context->stop_at_target;
+}
+
+bool stepper_get_init(stepper_context_t *stepper_context)
+{
+    return stepper_context->init;
+}
+
+int32_t stepper_get_position(stepper_context_t *stepper_context)
+{
+    stepper_snapshot_t snapshot;
+    stepper_get_snapshot(stepper_context, &snapshot);
+    return snapshot.position;
+}
+
+int32_t stepper_get_target(stepper_context_t *stepper_context)
+{
+    return stepper_context->target;
+}
+
+void stepper_get_rate(stepper_context_t *stepper_context, uint32_t *counts, uint32_t *interval_us)
+{
+    *counts = stepper_context->rate_counts;
+    *interval_us = stepper_context->rate_interval_us;
+}
+
+double stepper_get_speed(stepper_context_t *stepper_context)
+{
+    stepper_snapshot_t snapshot;
+    stepper_get_snapshot(stepper_context, &snapshot);
+    return snapshot.target_speed / 65536.0;
+}
+
+void stepper_get_snapshot(stepper_context_t *stepper_context, stepper_snapshot_t *snapshot)
+{
+    stepper_sync(stepper_context);
+
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&stepper_context->snapshot_seq, __ATOMIC_ACQUIRE);
+        *snapshot = stepper_context->snapshot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&stepper_context->snapshot_seq, __ATOMIC_RELAXED)));
+}
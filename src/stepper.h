@@ -0,0 +1,127 @@
+#pragma once
+
+#include "stepper_hal.h"
+#include "pid.h"
+#include "motion_profile.h"
+#include "guide.h"
+#include "rate.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// microsteps per worm revolution, set for the gearing of the add-on in build_flags
+#ifndef STEPPER_WORM_PERIOD
+#define STEPPER_WORM_PERIOD (200 * 16)
+#endif
+
+// steps per second, slower rates are stepped one pulse at a time from the control step
+#define STEPPER_RATE_MIN (STEPPER_HAL_RESOLUTION_HZ / STEPPER_HAL_PERIOD_MAX + 1)
+
+// the pulses follow the sum of the speed setpoints and guide corrections, a lag
+// is caught up in about this many periods
+#define STEPPER_CATCHUP_PERIODS 4
+
+// what the control ISR is doing, prepared in task context and taken over on start
+typedef struct {
+    bool direction;
+    bool stop_at_target;
+    int32_t target;
+    motion_profile_t profile;
+} stepper_run_t;
+
+typedef enum {
+    STEPPER_CMD_START,
+    STEPPER_CMD_STOP,
+    STEPPER_CMD_SET_POSITION,
+    STEPPER_CMD_SET_RATE,
+} stepper_cmd_type_t;
+
+typedef struct {
+    stepper_cmd_type_t type;
+    union {
+        int32_t position;
+        rate_t rate;
+        bool instant;           // stop without the deceleration ramp
+    };
+} stepper_cmd_t;
+
+#define STEPPER_MAILBOX_SIZE 8
+
+// published by the control ISR once per period
+typedef struct {
+    int32_t position;
+    int32_t target_speed;
+    bool running;
+} stepper_snapshot_t;
+
+typedef struct {
+    stepper_hal_t hal;
+
+    // owned by the control ISR, speeds in steps per period, Q16
+    rate_t rate;              // tracking setpoints
+    int32_t speed;            // ramped towards the rate by accel
+    int32_t accel;            // per period, set on init
+    int32_t max_rate;         // the slew speed, set on init
+    int64_t lag;              // setpoints not yet stepped, Q16
+    bool reverse;             // DIR output, switched by the ISR
+
+    int32_t position;
+    int32_t accumu_count;
+
+    stepper_run_t run;
+    bool running;
+    bool stopping;
+
+    // written by the command handlers and the ST-4 input, taken by the ISR
+    guide_t guide;
+
+    // producers serialized by post_lock, single consumer (the ISR)
+    SemaphoreHandle_t post_lock;
+    stepper_cmd_t mailbox[STEPPER_MAILBOX_SIZE];
+    uint32_t mailbox_head;
+    uint32_t mailbox_tail;
+
+    // seqlock, odd while the ISR is writing
+    uint32_t snapshot_seq;
+    stepper_snapshot_t snapshot;
+
+    // owned by the command handlers
+    stepper_run_t next_run;
+    uint32_t rate_counts;     // tracking rate, steps every rate_interval_us
+    uint32_t rate_interval_us;
+    double slew_speed;        // steps per second
+    double slew_accel;        // steps per second^2
+
+    bool direction;
+    bool stop_at_target;
+    int32_t target;
+    bool init;
+} stepper_context_t;
+
+void stepper_init(stepper_context_t *stepper_context);
+
+void stepper_start(stepper_context_t *stepper_context);
+// decelerates to a stop, instant stops on the spot
+void stepper_stop(stepper_context_t *stepper_context, bool instant);
+
+// power management, with the control step suspended and the axis stopped
+void stepper_suspend(stepper_context_t *stepper_context, bool suspend);
+
+void stepper_set_direction(stepper_context_t *stepper_context, bool direction);
+void stepper_set_stop_at_target(stepper_context_t *stepper_context, bool stop);
+void stepper_set_init(stepper_context_t *stepper_context, bool init);
+void stepper_set_position(stepper_context_t *stepper_context, int32_t position);
+void stepper_set_target(stepper_context_t *stepper_context, int32_t target);
+// tracking rate, steps every interval_us, kept exactly over any time
+void stepper_set_rate(stepper_context_t *stepper_context, uint32_t counts, uint32_t interval_us);
+
+bool stepper_get_direction(stepper_context_t *stepper_context);
+bool stepper_get_running(stepper_context_t *stepper_context);
+bool stepper_get_stop_at_target(stepper_context_t *stepper_context);
+bool stepper_get_init(stepper_context_t *stepper_context);
+int32_t stepper_get_position(stepper_context_t *stepper_context);
+int32_t stepper_get_target(stepper_context_t *stepper_context);
+double stepper_get_speed(stepper_context_t *stepper_context);
+void stepper_get_rate(stepper_context_t *stepper_context, uint32_t *counts, uint32_t *interval_us);
+
+// consistent copy of the control state, waits for commands still in the mailbox
+void stepper_get_snapshot(stepper_context_t *stepper_context, stepper_snapshot_t *snapshot);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "scheduler.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include "driver/pulse_cnt.h"
+#include "driver/mcpwm_prelude.h"
+#endif
+
+// STEP pulses come from an MCPWM timer, one per timer period, and are counted
+// back by a PCNT unit with DIR as its level input, so the position is exact
+// whatever the CPU does
+#define STEPPER_HAL_RESOLUTION_HZ 1000000
+#define STEPPER_HAL_PULSE_TICKS 4         // STEP high time
+#define STEPPER_HAL_PERIOD_MIN (STEPPER_HAL_PULSE_TICKS * 2 + 1)  // STEP low longer than high
+#define STEPPER_HAL_PERIOD_MAX 65535      // the timer period is 16 bits
+#define STEPPER_HAL_COUNT_LIMIT 30000
+
+// both callbacks run in interrupt context at CONTROL_INTR_PRIORITY, on_control
+// from the scheduler
+typedef struct {
+    bool (*on_control)(void *user_ctx);
+    void (*on_overflow)(int32_t value, void *user_ctx);
+} stepper_hal_callbacks_t;
+
+#if CONFIG_IDF_TARGET_LINUX
+
+// simulated pulse generator and counter
+typedef struct {
+    stepper_hal_callbacks_t cbs;
+    void *user_ctx;
+
+    bool enabled;
+    bool reverse;
+    uint32_t period;
+    int64_t since;          // us, the first pulse of the current period setting
+    int32_t count;
+} stepper_hal_t;
+
+#else
+
+typedef struct {
+    stepper_hal_callbacks_t cbs;
+    void *user_ctx;
+
+    mcpwm_timer_handle_t timer;
+    mcpwm_cmpr_handle_t pulse_start;
+    mcpwm_cmpr_handle_t pulse_end;
+    mcpwm_gen_handle_t generator;
+    pcnt_unit_handle_t pcnt_unit;
+    uint32_t period;        // 0 while the timer is stopped
+} stepper_hal_t;
+
+#endif
+
+void stepper_hal_init(stepper_hal_t *hal, const stepper_hal_callbacks_t *cbs, void *user_ctx);
+
+void stepper_hal_enable(stepper_hal_t *hal, bool enable);
+// releases the PM locks of the pulse timer and the counter, only while no
+// pulses are generated and the control step is suspended; the driver stays enabled
+void stepper_hal_suspend(stepper_hal_t *hal, bool suspend);
+// only while no pulses are generated, called by the control ISR
+void stepper_hal_set_direction(stepper_hal_t *hal, bool reverse);
+// pulse period in STEPPER_HAL_RESOLUTION_HZ ticks, STEPPER_HAL_PERIOD_MIN to
+// STEPPER_HAL_PERIOD_MAX, 0 stops
+void stepper_hal_set_period(stepper_hal_t *hal, uint32_t period);
+// a single pulse, for rates below one per STEPPER_HAL_PERIOD_MAX, the period must be 0
+void stepper_hal_step(stepper_hal_t *hal);
+
+int32_t stepper_hal_get_count(stepper_hal_t *hal);
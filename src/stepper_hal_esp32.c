@@ -0,0 +1,171 @@
+#include "sdkconfig.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+
+#include "stepper_hal.h"
+
+const gpio_num_t STEP_GPIO = (gpio_num_t)25;
+const gpio_num_t DIR_GPIO = (gpio_num_t)26;
+const gpio_num_t EN_GPIO = (gpio_num_t)27;    // active low
+
+
+static bool IRAM_ATTR pcnt_on_reach(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx)
+{
+    stepper_hal_t *hal = (stepper_hal_t *)user_ctx;
+    hal->cbs.on_overflow(edata->watch_point_value, hal->user_ctx);
+    return false;
+}
+
+static bool IRAM_ATTR control_callback(void *user_ctx)
+{
+    stepper_hal_t *hal = (stepper_hal_t *)user_ctx;
+    return hal->cbs.on_control(hal->user_ctx);
+}
+
+
+void stepper_hal_init(stepper_hal_t *hal, const stepper_hal_callbacks_t *cbs, void *user_ctx)
+{
+    hal->cbs = *cbs;
+    hal->user_ctx = user_ctx;
+    hal->period = 0;
+
+    // DIR is read back by the PCNT unit
+    gpio_config_t io_config = {
+        .pin_bit_mask = (1ULL << DIR_GPIO) | (1ULL << EN_GPIO),
+        .mode = GPIO_MODE_INPUT_OUTPUT,
+    };
+    ESP_ERROR_CHECK(gpio_config(&io_config));
+    ESP_ERROR_CHECK(gpio_set_level(EN_GPIO, 1));
+    ESP_ERROR_CHECK(gpio_set_level(DIR_GPIO, 0));
+
+    pcnt_unit_config_t unit_config = {
+        .high_limit = STEPPER_HAL_COUNT_LIMIT,
+        .low_limit = -STEPPER_HAL_COUNT_LIMIT,
+        .intr_priority = CONTROL_INTR_PRIORITY,
+    };
+    ESP_ERROR_CHECK(pcnt_new_unit(&unit_config, &hal->pcnt_unit));
+
+    // count on the rising STEP edge, down while DIR is high
+    pcnt_chan_config_t chan_config = {
+        .edge_gpio_num = STEP_GPIO,
+        .level_gpio_num = DIR_GPIO,
+        .flags.io_loop_back = true,
+    };
+    pcnt_channel_handle_t pcnt_chan = NULL;
+    ESP_ERROR_CHECK(pcnt_new_channel(hal->pcnt_unit, &chan_config, &pcnt_chan));
+    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD));
+    ESP_ERROR_CHECK(pcnt_channel_set_level_action(pcnt_chan, PCNT_CHANNEL_LEVEL_ACTION_INVERSE, PCNT_CHANNEL_LEVEL_ACTION_KEEP));
+
+    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(hal->pcnt_unit, STEPPER_HAL_COUNT_LIMIT));
+    ESP_ERROR_CHECK(pcnt_unit_add_watch_point(hal->pcnt_unit, -STEPPER_HAL_COUNT_LIMIT));
+    pcnt_event_callbacks_t pcnt_cbs = {
+        .on_reach = pcnt_on_reach, // accumulate the overflow in the callback
+    };
+    ESP_ERROR_CHECK(pcnt_unit_register_event_callbacks(hal->pcnt_unit, &pcnt_cbs, hal));
+
+    ESP_ERROR_CHECK(pcnt_unit_enable(hal->pcnt_unit));
+    ESP_ERROR_CHECK(pcnt_unit_clear_count(hal->pcnt_unit));
+    ESP_ERROR_CHECK(pcnt_unit_start(hal->pcnt_unit));
+
+
+    // the DC motor has group 0
+    mcpwm_timer_config_t timer_config = {
+        .group_id = 1,
+        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
+        .resolution_hz = STEPPER_HAL_RESOLUTION_HZ,
+        .period_ticks = STEPPER_HAL_PULSE_TICKS * 2 + 1,
+        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
+        .flags.update_period_on_empty = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &hal->timer));
+
+    mcpwm_oper_handle_t oper = NULL;
+    mcpwm_operator_config_t operator_config = {
+        .group_id = 1,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &oper));
+    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(oper, hal->timer));
+
+    mcpwm_comparator_config_t comparator_config = {
+        .flags.update_cmp_on_tez = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_comparator(oper, &comparator_config, &hal->pulse_start));
+    ESP_ERROR_CHECK(mcpwm_new_comparator(oper, &comparator_config, &hal->pulse_end));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(hal->pulse_start, 1));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(hal->pulse_end, 1 + STEPPER_HAL_PULSE_TICKS));
+
+    mcpwm_generator_config_t generator_config = {
+        .gen_gpio_num = STEP_GPIO,
+        .flags.io_loop_back = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_generator(oper, &generator_config, &hal->generator));
+
+    // the pulse is at the start of the period, a single period run with
+    // START_STOP_FULL gives exactly one
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(hal->generator,
+                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, hal->pulse_start, MCPWM_GEN_ACTION_HIGH),
+                    MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, hal->pulse_end, MCPWM_GEN_ACTION_LOW),
+                    MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+
+    ESP_ERROR_CHECK(mcpwm_timer_enable(hal->timer));
+
+    scheduler_add(control_callback, hal);
+}
+
+void stepper_hal_enable(stepper_hal_t *hal, bool enable)
+{
+    ESP_ERROR_CHECK(gpio_set_level(EN_GPIO, !enable));
+}
+
+void stepper_hal_suspend(stepper_hal_t *hal, bool suspend)
+{
+    if (suspend) {
+        ESP_ERROR_CHECK(mcpwm_timer_disable(hal->timer));
+        ESP_ERROR_CHECK(pcnt_unit_stop(hal->pcnt_unit));
+        ESP_ERROR_CHECK(pcnt_unit_disable(hal->pcnt_unit));
+    }
+    else {
+        ESP_ERROR_CHECK(pcnt_unit_enable(hal->pcnt_unit));
+        ESP_ERROR_CHECK(pcnt_unit_start(hal->pcnt_unit));
+        ESP_ERROR_CHECK(mcpwm_timer_enable(hal->timer));
+    }
+}
+
+void IRAM_ATTR stepper_hal_set_direction(stepper_hal_t *hal, bool reverse)
+{
+    ESP_ERROR_CHECK(gpio_set_level(DIR_GPIO, reverse));
+}
+
+void IRAM_ATTR stepper_hal_set_period(stepper_hal_t *hal, uint32_t period)
+{
+    if (period == hal->period) return;
+
+    if (period == 0) {
+        // finishes the current period, then stays short for stepper_hal_step
+        ESP_ERROR_CHECK(mcpwm_timer_set_period(hal->timer, STEPPER_HAL_PERIOD_MIN));
+        ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_STOP_EMPTY));
+    }
+    else {
+        // taken on the next TEZ
+        ESP_ERROR_CHECK(mcpwm_timer_set_period(hal->timer, period));
+        if (hal->period == 0) ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_START_NO_STOP));
+    }
+    hal->period = period;
+}
+
+void IRAM_ATTR stepper_hal_step(stepper_hal_t *hal)
+{
+    ESP_ERROR_CHECK(mcpwm_timer_start_stop(hal->timer, MCPWM_TIMER_START_STOP_FULL));
+}
+
+int32_t IRAM_ATTR stepper_hal_get_count(stepper_hal_t *hal)
+{
+    int count;
+    ESP_ERROR_CHECK(pcnt_unit_get_count(hal->pcnt_unit, &count));
+    return count;
+}
+
+#endif
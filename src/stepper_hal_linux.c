@@ -0,0 +1,92 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+
+#include "stepper_hal.h"
+
+static int64_t sim_ticks(void)
+{
+    return scheduler_get_time() * STEPPER_HAL_RESOLUTION_HZ / 1000000;
+}
+
+static void sim_count(stepper_hal_t *hal, int32_t delta)
+{
+    // the PCNT unit resets to zero when it reaches a limit and reports the watch point
+    while (delta != 0) {
+        int32_t step = (delta > 0) ? 1 : -1;
+        hal->count += step;
+        delta -= step;
+        if (hal->count == STEPPER_HAL_COUNT_LIMIT || hal->count == -STEPPER_HAL_COUNT_LIMIT) {
+            int32_t value = hal->count;
+            hal->count = 0;
+            hal->cbs.on_overflow(value, hal->user_ctx);
+        }
+    }
+}
+
+// pulses generated up to now, since is the time of the next one
+static void sim_advance(stepper_hal_t *hal)
+{
+    int64_t now = sim_ticks();
+    if ((hal->period == 0) || (now < hal->since)) return;
+
+    int64_t pulses = (now - hal->since) / hal->period + 1;
+    hal->since += pulses * hal->period;
+    if (hal->enabled) sim_count(hal, hal->reverse ? -pulses : pulses);
+}
+
+static bool sim_control(void *user_ctx)
+{
+    stepper_hal_t *hal = (stepper_hal_t *)user_ctx;
+    sim_advance(hal);
+    return hal->cbs.on_control(hal->user_ctx);
+}
+
+
+void stepper_hal_init(stepper_hal_t *hal, const stepper_hal_callbacks_t *cbs, void *user_ctx)
+{
+    hal->cbs = *cbs;
+    hal->user_ctx = user_ctx;
+    hal->enabled = false;
+    hal->reverse = false;
+    hal->period = 0;
+    hal->since = 0;
+    hal->count = 0;
+
+    scheduler_add(sim_control, hal);
+}
+
+void stepper_hal_enable(stepper_hal_t *hal, bool enable)
+{
+    hal->enabled = enable;
+}
+
+void stepper_hal_suspend(stepper_hal_t *hal, bool suspend)
+{
+}
+
+void stepper_hal_set_direction(stepper_hal_t *hal, bool reverse)
+{
+    hal->reverse = reverse;
+}
+
+void stepper_hal_set_period(stepper_hal_t *hal, uint32_t period)
+{
+    sim_advance(hal);
+    // a running timer takes the new period on the next TEZ
+    if (hal->period == 0) hal->since = sim_ticks();
+    hal->period = period;
+}
+
+void stepper_hal_step(stepper_hal_t *hal)
+{
+    if (hal->enabled) sim_count(hal, hal->reverse ? -1 : 1);
+}
+
+int32_t stepper_hal_get_count(stepper_hal_t *hal)
+{
+    sim_advance(hal);
+    return hal->count;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "stream.h"
+#include "eqmod_uart.h"
+#include "udp_server.h"
+#include "scheduler.h"
+
+// a few periods, a subscriber that can't keep up loses frames
+#define STREAM_QUEUE_LEN 4
+
+static QueueHandle_t stream_queue;
+static uint32_t period_us[SW_SOURCES];    // 0 not subscribed
+static int64_t due[SW_SOURCES];
+
+// control task, only picks the due subscribers; the frame reads the command
+// state, which must not hold up the control step
+static void stream_on_control_task(void *user_ctx)
+{
+    int64_t now = scheduler_get_time();
+    uint8_t sources = 0;    // bit per sw_source_t
+    for (int i = 0; i < SW_SOURCES; i++) {
+        uint32_t period = __atomic_load_n(&period_us[i], __ATOMIC_ACQUIRE);
+        if (!period || (now < due[i])) continue;
+        // skipped periods are not made up
+        due[i] = (now - due[i] >= period) ? now + period : due[i] + period;
+        sources |= 1 << i;
+    }
+    if (!sources) return;
+
+    xQueueSend(stream_queue, &sources, 0);
+}
+
+static void stream_task(void *pvParameters)
+{
+    uint8_t sources;
+    char frame[STREAM_FRAME_LEN];
+    while (1) {
+        xQueueReceive(stream_queue, &sources, portMAX_DELAY);
+        // encoded once for all due subscribers
+        sw_stream_frame(frame);
+        if (sources & (1 << SW_SOURCE_UART)) eqmod_uart_write(frame, STREAM_FRAME_LEN);
+        if (sources & (1 << SW_SOURCE_UDP)) udp_server_stream_write(frame, STREAM_FRAME_LEN);
+    }
+}
+
+void stream_init(void)
+{
+    stream_queue = xQueueCreate(STREAM_QUEUE_LEN, sizeof(uint8_t));
+    // below the command handlers like the telemetry
+    xTaskCreatePinnedToCore(stream_task, "stream", 2048, NULL, 1, NULL, COMMS_CORE);
+    scheduler_add_task(stream_on_control_task, NULL);
+}
+
+void stream_subscribe(sw_source_t source, uint32_t rate_hz)
+{
+    if (source == SW_SOURCE_UDP) udp_server_stream_subscribe(rate_hz != 0);
+    __atomic_store_n(&period_us[source], rate_hz ? 1000000 / rate_hz : 0, __ATOMIC_RELEASE);
+}
+
+bool stream_get_enabled(void)
+{
+    for (int i = 0; i < SW_SOURCES; i++) {
+        if (__atomic_load_n(&period_us[i], __ATOMIC_RELAXED)) return true;
+    }
+    return false;
+}
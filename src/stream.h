@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sw_protocol.h"
+
+// unsolicited position and status frames instead of :j and :f polling, sent
+// to the interface the subscription came from (for UDP, its sender). The
+// control task picks the due subscribers, the stream task encodes one frame
+// for all of them under the command lock and sends it:
+//   '#', :j payload of axis 1, :f payload of axis 1, the same for axis 2, CR
+// '#' never starts a reply, so frames and replies can interleave.
+#define STREAM_FRAME_LEN (1 + 2 * (6 + 3) + 1)
+#define STREAM_MAX_RATE_HZ 50
+
+// before scheduler_start
+void stream_init(void);
+
+// frames per second, 0 unsubscribes
+void stream_subscribe(sw_source_t source, uint32_t rate_hz);
+bool stream_get_enabled(void);
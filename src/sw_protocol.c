@@ -1,451 +1,801 @@
 #include <stdio.h>
-#include "motor.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "axis.h"
+#include "telemetry.h"
+#include "timing.h"
+#include "power.h"
+#include "stream.h"
+#include "sw_protocol.h"
 
 #define CMD_LEN_ERROR 1
+#define CMD_MOTOR_NOT_STOPPED 2
 #define CMD_INVALID_CHAR 3
+#define CMD_PEC_TRAINING 7
+#define CMD_PEC_NO_DATA 8
+#define CMD_NOT_TRACKING 9
 #define CMD_UNKNOWN 0
 
-#define STEPS_MUL 4
 #define STEPS_OFF 0x800000
 
-extern dc_motor_context_t dc_motor_context;
+// commands arrive from the UART and the network
+static SemaphoreHandle_t command_lock;
+static sw_source_t command_source;  // under command_lock
 
-uint32_t hex(char c)
-{
-    if ((c >= '0') && (c <= '9')) return c - '0';
-    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
-    return 0;
-}
+// timing histogram of each opcode, 1 + offset from TIMING_COMMAND, 0 for none
+static uint8_t command_timing[128];
 
-int parse6(char *cmd, uint32_t *res)
-{
-    if ((cmd[9] != 0x0d) && (cmd[9] != 0x0a)) return 0;
-    *res = hex(cmd[7]);
-    *res <<= 4;
-    *res |= hex(cmd[8]);
-    *res <<= 4;
-    *res |= hex(cmd[5]);
-    *res <<= 4;
-    *res |= hex(cmd[6]);
-    *res <<= 4;
-    *res |= hex(cmd[3]);
-    *res <<= 4;
-    *res |= hex(cmd[4]);
-    return 1;  
-}
+#define HEX_DIGIT(n) ((n) < 10 ? '0' + (n) : 'A' + (n) - 10)
+#define HEX_PAIR(b) { HEX_DIGIT((b) >> 4), HEX_DIGIT((b) & 0x0F) }
+#define HEX_ROW(h) HEX_PAIR(h * 16 + 0), HEX_PAIR(h * 16 + 1), HEX_PAIR(h * 16 + 2), HEX_PAIR(h * 16 + 3), \
+                   HEX_PAIR(h * 16 + 4), HEX_PAIR(h * 16 + 5), HEX_PAIR(h * 16 + 6), HEX_PAIR(h * 16 + 7), \
+                   HEX_PAIR(h * 16 + 8), HEX_PAIR(h * 16 + 9), HEX_PAIR(h * 16 + 10), HEX_PAIR(h * 16 + 11), \
+                   HEX_PAIR(h * 16 + 12), HEX_PAIR(h * 16 + 13), HEX_PAIR(h * 16 + 14), HEX_PAIR(h * 16 + 15)
+
+static const char hex_byte[256][2] = {
+    HEX_ROW(0), HEX_ROW(1), HEX_ROW(2), HEX_ROW(3), HEX_ROW(4), HEX_ROW(5), HEX_ROW(6), HEX_ROW(7),
+    HEX_ROW(8), HEX_ROW(9), HEX_ROW(10), HEX_ROW(11), HEX_ROW(12), HEX_ROW(13), HEX_ROW(14), HEX_ROW(15),
+};
+
+// nibble value + 1, 0 for characters that are not hex digits
+static const uint8_t hex_nibble[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+    ['8'] = 9, ['9'] = 10, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
 
-int parse2(char *cmd, uint32_t *res)
+static inline char *put_byte(char *resp, uint32_t v)
 {
-    if ((cmd[5] != 0x0d) && (cmd[5] != 0x0a)) return 0;
-    *res = hex(cmd[3]);
-    *res <<= 4;
-    *res |= hex(cmd[4]);
-    return 1;  
+    resp[0] = hex_byte[v & 0xFF][0];
+    resp[1] = hex_byte[v & 0xFF][1];
+    return resp + 2;
 }
 
-char hexd[] = "0123456789ABCDEF";
-
 int resp6(char *resp, uint32_t v)
 {
     resp[0] = '=';
-    resp[1] = hexd[(v & 0xF0) >> 4];
-    resp[2] = hexd[(v & 0x0F)];
-    resp[3] = hexd[(v & 0xF000) >> 12];
-    resp[4] = hexd[(v & 0x0F00) >> 8];
-    resp[5] = hexd[(v & 0xF00000) >> 20];
-    resp[6] = hexd[(v & 0x0F0000) >> 16];
+    put_byte(resp + 1, v);
+    put_byte(resp + 3, v >> 8);
+    put_byte(resp + 5, v >> 16);
     resp[7] = 0x0d;
-    return 1;
+    return 8;
 }
 
 int resp3(char *resp, uint32_t v)
 {
     resp[0] = '=';
-    resp[1] = hexd[(v & 0xF0) >> 4];
-    resp[2] = hexd[(v & 0x0F)];
-    resp[3] = hexd[(v & 0x0F00) >> 8];
+    put_byte(resp + 1, v);
+    resp[3] = hex_byte[(v >> 8) & 0x0F][1];
     resp[4] = 0x0d;
-    return 1;
+    return 5;
 }
 
 
 int resp2(char *resp, uint32_t v)
 {
     resp[0] = '=';
-    resp[1] = hexd[(v & 0xF0) >> 4];
-    resp[2] = hexd[(v & 0x0F)];
+    put_byte(resp + 1, v);
     resp[3] = 0x0d;
-    return 1;
+    return 4;
 }
 
 int sw_ok(char *resp)
 {
     resp[0] = '=';
     resp[1] = 0x0d;
-    return 0;
+    return 2;
 }
 
 
 int sw_error(char *resp, int code)
 {
     resp[0] = '!';
-    resp[1] = hexd[code];
+    resp[1] = hex_byte[code][1];
     resp[2] = 0x0d;
-    return 0;
+    return 3;
 }
 
 
-static int set_position(char *cmd, char *resp)
+// '1' and '2' select one axis, '3' both
+static inline axis_t *axis_first(char axis)
 {
-    uint32_t pos;
-    if (!parse6(cmd, &pos)) return sw_error(resp, CMD_LEN_ERROR);
+    return &axes[(axis == '2') ? 1 : 0];
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_set_position(&dc_motor_context, ((int32_t)pos - STEPS_OFF)*STEPS_MUL);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_set_position(&dc_motor_context, ((int32_t)pos - STEPS_OFF)*STEPS_MUL);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+static inline axis_t *axis_last(char axis)
+{
+    return &axes[(axis == '1') ? 0 : AXES - 1];
+}
+
+#define FOR_AXES(a, axis) for (axis_t *a = axis_first(axis); a <= axis_last(axis); a++)
+
+// the backlash measurement drives its own gotos, motion commands wait for it
+static bool axes_measuring(char axis)
+{
+    FOR_AXES(a, axis) {
+        if ((a->type == AXIS_DC_MOTOR) && (dc_motor_get_backlash_state(a->dc_motor) == BACKLASH_MEASURING)) return true;
     }
+    return false;
+}
+
+static int set_position(char axis, uint32_t pos, char *resp)
+{
+    if (axes_measuring(axis)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+    FOR_AXES(a, axis) axis_set_position(a, ((int32_t)pos - STEPS_OFF) * a->steps_mul);
     return sw_ok(resp);
 }
 
-static int init_done(char *cmd, char *resp)
+static int init_done(char axis, uint32_t value, char *resp)
 {
-    dc_motor_set_init(&dc_motor_context, true);
+    FOR_AXES(a, axis) axis_set_init(a, true);
     return sw_ok(resp);
 }
 
-static int set_mode(char *cmd, char *resp)
+// first digit of :G, 0 goto fast, 1 tracking slow, 2 goto slow, 3 tracking fast
+#define MODE_TRACKING 0x10
+
+static int32_t axis_rate_mul(axis_t *a)
 {
-    uint32_t mode;
-    if (!parse2(cmd, &mode)) return sw_error(resp, CMD_LEN_ERROR);
+    return a->steps_mul * (a->fast ? a->high_speed : 1);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_set_direction(&dc_motor_context, mode & 0x01);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_set_direction(&dc_motor_context, mode & 0x01);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+// a period set before keeps its meaning in the new mode
+static void mode_rate(axis_t *a, bool fast, uint32_t *counts, uint32_t *interval_us)
+{
+    axis_get_rate(a, counts, interval_us);
+    if (!*counts || (fast == a->fast)) return;
+    if (fast) *counts *= a->high_speed;
+    else if (*counts % a->high_speed == 0) *counts /= a->high_speed;
+    else *interval_us *= a->high_speed;
+}
+
+static int set_mode(char axis, uint32_t mode, char *resp)
+{
+    uint32_t digit = mode >> 4;
+    bool fast = (digit == 0) || (digit == 3);
+    uint32_t counts, interval_us;
+    if (axes_measuring(axis)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+    FOR_AXES(a, axis) {
+        // like the SynScan, the mode only changes with the axis stopped
+        if (axis_get_running(a)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+        mode_rate(a, fast, &counts, &interval_us);
+        if (!rate_fits(counts, interval_us)) return sw_error(resp, CMD_INVALID_CHAR);
+    }
+    FOR_AXES(a, axis) {
+        axis_set_direction(a, mode & 0x01);
+        axis_set_stop_at_target(a, !(mode & MODE_TRACKING));
+        if (fast != a->fast) {
+            mode_rate(a, fast, &counts, &interval_us);
+            a->fast = fast;
+            if (counts) axis_set_rate(a, counts, interval_us);
+        }
     }
     return sw_ok(resp);
 }
 
-static int set_target(char *cmd, char *resp)
+static int set_target(char axis, uint32_t pos, char *resp)
 {
-    uint32_t pos;
-    if (!parse6(cmd, &pos)) return sw_error(resp, CMD_LEN_ERROR);
+    if (axes_measuring(axis)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+    FOR_AXES(a, axis) axis_set_target(a, ((int32_t)pos - STEPS_OFF) * a->steps_mul);
+    return sw_ok(resp);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_set_target(&dc_motor_context, ((int32_t)pos - STEPS_OFF)*STEPS_MUL);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_set_target(&dc_motor_context, ((int32_t)pos - STEPS_OFF)*STEPS_MUL);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+static int set_period(char axis, uint32_t period, char *resp)
+{
+    // one step every period us, high_speed in the fast modes, a period of 0 stops tracking
+    FOR_AXES(a, axis) {
+        if (!rate_fits(axis_rate_mul(a), period)) return sw_error(resp, CMD_INVALID_CHAR);
     }
+    FOR_AXES(a, axis) axis_set_rate(a, axis_rate_mul(a), period);
     return sw_ok(resp);
 }
 
-static int set_period(char *cmd, char *resp)
+static int start(char axis, uint32_t value, char *resp)
 {
-    uint32_t period;
-    if (!parse6(cmd, &period)) return sw_error(resp, CMD_LEN_ERROR);
+    if (axes_measuring(axis)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+    FOR_AXES(a, axis) axis_start(a);
+    return sw_ok(resp);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_set_speed(&dc_motor_context, 50000.0 / period * STEPS_MUL);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_set_speed(&dc_motor_context, 50000.0 / period * STEPS_MUL);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+static int stop(char axis, uint32_t value, char *resp)
+{
+    FOR_AXES(a, axis) axis_stop(a, false);
     return sw_ok(resp);
 }
 
-static int start(char *cmd, char *resp)
+static int instant_stop(char axis, uint32_t value, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
+    FOR_AXES(a, axis) axis_stop(a, true);
+    return sw_ok(resp);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_start(&dc_motor_context);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_start(&dc_motor_context);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+static int set_aux(char axis, uint32_t value, char *resp)
+{
     return sw_ok(resp);
 }
 
-static int stop(char *cmd, char *resp)
+// :P digit, fraction of the sidereal rate added or subtracted while a guide
+// correction is active
+static const double guide_rates[] = { 1.0, 0.75, 0.5, 0.25, 0.125 };
+
+static int set_guiding(char axis, uint32_t value, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
+    uint32_t digit = value >> 4;
+    if (digit >= sizeof(guide_rates) / sizeof(guide_rates[0])) return sw_error(resp, CMD_INVALID_CHAR);
+    FOR_AXES(a, axis) axis_set_guide_rate(a, guide_rates[digit]);
+    return sw_ok(resp);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_stop(&dc_motor_context);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_stop(&dc_motor_context);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+static int set_led(char axis, uint32_t value, char *resp)
+{
     return sw_ok(resp);
 }
 
-static int instant_stop(char *cmd, char *resp)
+// the inquiries are for a single axis
+
+static int get_cpr(char axis, uint32_t value, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
+    axis_t *a = axis_first(axis);
+    return resp6(resp, a->worm_period * WORM_TEETH / a->steps_mul);
+}
 
-    switch (cmd[2]) {
-        case '1':
-            dc_motor_stop(&dc_motor_context);
-            break;
-        case '2':
-//            stepper_set_position(pos);
-            break;
-        case '3':
-            dc_motor_stop(&dc_motor_context);
-//            stepper_set_position(pos);
-            break;
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+static int get_freq(char axis, uint32_t value, char *resp)
+{
+    return resp6(resp, 1000000);
+}
+
+static int get_target(char axis, uint32_t value, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    return resp6(resp, axis_get_target(a) / a->steps_mul + STEPS_OFF);
+}
+
+static int get_period(char axis, uint32_t value, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    uint32_t counts, interval_us;
+    axis_get_rate(a, &counts, &interval_us);
+    if (!counts) return resp6(resp, 0);
+    return resp6(resp, (uint64_t)interval_us * axis_rate_mul(a) / counts);
+}
+
+
+static uint32_t axis_pos(axis_t *a)
+{
+    return axis_get_position(a) / a->steps_mul + STEPS_OFF;
+}
+
+static int get_pos(char axis, uint32_t value, char *resp)
+{
+    return resp6(resp, axis_pos(axis_first(axis)));
+}
+
+#define STATUS_RUNNING  0x001
+#define STATUS_TRACKING 0x010
+#define STATUS_CCW      0x020
+#define STATUS_FAST     0x040
+#define STATUS_INIT     0x100
+
+
+static uint32_t axis_status(axis_t *a)
+{
+    uint32_t status = 0;
+    if (axis_get_running(a)) status |= STATUS_RUNNING;
+    if (!axis_get_stop_at_target(a)) status |= STATUS_TRACKING;
+    if (axis_get_direction(a)) status |= STATUS_CCW;
+    if (a->fast) status |= STATUS_FAST;
+    if (axis_get_init(a)) status |= STATUS_INIT;
+    return status;
+}
+
+static int get_status(char axis, uint32_t value, char *resp)
+{
+    return resp3(resp, axis_status(axis_first(axis)));
+}
+
+static int get_high_speed(char axis, uint32_t value, char *resp)
+{
+    return resp2(resp, axis_first(axis)->high_speed);
+}
+
+static int get_1x(char axis, uint32_t value, char *resp)
+{
+    return resp6(resp, axis_first(axis)->worm_period);
+}
+
+static int get_version(char axis, uint32_t value, char *resp)
+{
+    return resp6(resp, 0x123456);
+}
+
+
+// :X vendor extension, the first payload byte selects the subcommand,
+// the remaining up to 4 digits are its argument
+#define EXT_TELEMETRY          0x01 // arg 1 streams control loop records, 0 stops
+#define EXT_TELEMETRY_DROPPED  0x02 // records lost since the last reset
+#define EXT_TELEMETRY_RESET    0x03
+
+static int ext_telemetry(char axis, uint32_t arg, char *resp)
+{
+    telemetry_enable(arg != 0);
+    return sw_ok(resp);
+}
+
+static int ext_telemetry_dropped(char axis, uint32_t arg, char *resp)
+{
+    return resp6(resp, telemetry_get_dropped());
+}
+
+static int ext_telemetry_reset(char axis, uint32_t arg, char *resp)
+{
+    telemetry_reset_dropped();
+    return sw_ok(resp);
+}
+
+#define EXT_PEC_RECORD         0x10 // arg worm cycles to record while tracking, 0 stops
+#define EXT_PEC_STATUS         0x11 // bit 0 recording, bit 1 table stored, bit 2 playing back
+#define EXT_PEC_PLAYBACK       0x12 // arg 1 plays the table back, 0 stops
+#define EXT_PEC_SAVE           0x13 // turn the finished recording into the table
+
+static pec_t *axis_pec(char axis)
+{
+    axis_t *a = axis_first(axis);
+    // the stepper has no PEC
+    return (a->type == AXIS_DC_MOTOR) ? &a->dc_motor->pec : NULL;
+}
+
+static int ext_pec_record(char axis, uint32_t arg, char *resp)
+{
+    pec_t *pec = axis_pec(axis);
+    if (!pec) return sw_ok(resp);
+    if (arg == 0) {
+        pec_stop_recording(pec);
+        return sw_ok(resp);
     }
+    if (!pec_start_recording(pec, arg)) return sw_error(resp, CMD_PEC_TRAINING);
     return sw_ok(resp);
 }
 
-static int set_aux(char *cmd, char *resp)
+static int ext_pec_status(char axis, uint32_t arg, char *resp)
 {
+    pec_t *pec = axis_pec(axis);
+    if (!pec) return resp2(resp, 0);
+    return resp2(resp, (pec->recording ? 0x01 : 0) | (pec->valid ? 0x02 : 0) | (pec->enabled ? 0x04 : 0));
+}
+
+static int ext_pec_playback(char axis, uint32_t arg, char *resp)
+{
+    pec_t *pec = axis_pec(axis);
+    if (pec) pec_enable(pec, arg != 0);
     return sw_ok(resp);
 }
 
-static int set_guiding(char *cmd, char *resp)
+static int ext_pec_save(char axis, uint32_t arg, char *resp)
 {
+    pec_t *pec = axis_pec(axis);
+    if (!pec) return sw_ok(resp);
+    if (pec->recording) return sw_error(resp, CMD_PEC_TRAINING);
+    if (!pec_save(pec)) return sw_error(resp, CMD_PEC_NO_DATA);
     return sw_ok(resp);
 }
 
-static int set_led(char *cmd, char *resp)
+#define EXT_AUTOTUNE           0x20 // arg relay amplitude in 1/1000 of full duty, 0 picks one
+#define EXT_AUTOTUNE_STATUS    0x21 // 0 idle, 1 starting, 2 running, 3 done, 4 failed
+#define EXT_GAIN               0x22 // arg regime * 16 + 0 kp, 1 ki, 2 kd, in 1e-8 units
+#define EXT_DUTY_MAP           0x23 // arg direction * 16 + point, learned duty in 1e-6, FFFFFF none
+#define EXT_DUTY_MAP_CLEAR     0x24
+#define EXT_BACKLASH           0x25 // counts taken up on a reversal
+#define EXT_BACKLASH_SET       0x26 // arg counts
+#define EXT_BACKLASH_MEASURE   0x27 // while stopped
+#define EXT_BACKLASH_STATUS    0x28 // 0 idle, 1 measuring, 2 done, 3 failed
+#define EXT_REGIME             0x29 // gains in use, 0 tracking, 1 slew, 2 guiding
+
+static int ext_autotune(char axis, uint32_t arg, char *resp)
 {
+    axis_t *a = axis_first(axis);
+    if (a->type != AXIS_DC_MOTOR) return sw_ok(resp);
+    // relay amplitude in 1/1000 duty, at most full duty
+    if (arg > 1000) return sw_error(resp, CMD_INVALID_CHAR);
+    if (!dc_motor_autotune(a->dc_motor, arg / 1000.0)) return sw_error(resp, CMD_NOT_TRACKING);
     return sw_ok(resp);
 }
 
-static int get_cpr(char *cmd, char *resp)
+static int ext_autotune_status(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, DC_WORM_PERIOD * 144 / STEPS_MUL);
-        case '2':
-            return resp6(resp, DC_WORM_PERIOD * 144 / STEPS_MUL);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+    axis_t *a = axis_first(axis);
+    if (a->type != AXIS_DC_MOTOR) return resp2(resp, AUTOTUNE_IDLE);
+    return resp2(resp, dc_motor_get_autotune_state(a->dc_motor));
 }
 
-static int get_freq(char *cmd, char *resp)
+static int ext_gain(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, 1000000);
-        case '2':
-            return resp6(resp, 1000000);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+    axis_t *a = axis_first(axis);
+    int regime = arg >> 4;
+    if ((a->type != AXIS_DC_MOTOR) || (regime >= DC_MOTOR_REGIMES)) return sw_error(resp, CMD_INVALID_CHAR);
+
+    const dc_motor_tuning_t *tuning = &a->dc_motor->tuning[regime];
+    double gain;
+    switch (arg & 0x0F) {
+        case 0: gain = tuning->kp; break;
+        case 1: gain = tuning->ki; break;
+        case 2: gain = tuning->kd; break;
+        default: return sw_error(resp, CMD_INVALID_CHAR);
     }
+    // 24 bits hold gains up to 0.167, larger or negative ones saturate
+    double units = gain * 1e8 + 0.5;
+    if (units < 0) units = 0;
+    if (units > 0xFFFFFF) units = 0xFFFFFF;
+    return resp6(resp, units);
 }
 
-static int get_target(char *cmd, char *resp)
+static int ext_duty_map(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, dc_motor_get_target(&dc_motor_context) / STEPS_MUL + STEPS_OFF);
-        case '2':
-            return resp6(resp, dc_motor_get_target(&dc_motor_context) / STEPS_MUL + STEPS_OFF);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+    axis_t *a = axis_first(axis);
+    uint32_t direction = arg >> 4;
+    uint32_t point = arg & 0x0F;
+    if ((a->type != AXIS_DC_MOTOR) || (direction > 1)) return sw_error(resp, CMD_INVALID_CHAR);
+
+    const duty_map_t *map = &a->dc_motor->duty_map;
+    if (!(map->valid[direction] & (1u << point))) return resp6(resp, 0xFFFFFF);
+    return resp6(resp, PID_GAIN_TO_DOUBLE(map->duty[direction][point]) * 1e6 + 0.5);
 }
 
-static int get_period(char *cmd, char *resp)
+static int ext_duty_map_clear(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, 300 / STEPS_MUL);
-        case '2':
-            return resp6(resp, 300 / STEPS_MUL);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+    FOR_AXES(a, axis) {
+        if (a->type == AXIS_DC_MOTOR) duty_map_clear(&a->dc_motor->duty_map);
     }
+    return sw_ok(resp);
 }
 
+static int ext_backlash(char axis, uint32_t arg, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    if (a->type != AXIS_DC_MOTOR) return resp6(resp, 0);
+    return resp6(resp, a->dc_motor->backlash.counts);
+}
 
-static int get_pos(char *cmd, char *resp)
+static int ext_backlash_set(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, dc_motor_get_position(&dc_motor_context) / STEPS_MUL + STEPS_OFF);
-        case '2':
-            return resp6(resp, dc_motor_get_position(&dc_motor_context) / STEPS_MUL + STEPS_OFF);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+    if (arg > BACKLASH_MAX) return sw_error(resp, CMD_INVALID_CHAR);
+    FOR_AXES(a, axis) {
+        if (a->type == AXIS_DC_MOTOR) dc_motor_set_backlash(a->dc_motor, arg);
     }
+    return sw_ok(resp);
 }
 
-#define STATUS_RUNNING  0x001
-#define STATUS_TRACKING 0x010
-#define STATUS_CCW      0x020
-#define STATUS_FAST     0x020
-#define STATUS_INIT     0x100
+static int ext_backlash_measure(char axis, uint32_t arg, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    if (a->type != AXIS_DC_MOTOR) return sw_ok(resp);
+    if (!dc_motor_measure_backlash(a->dc_motor)) return sw_error(resp, CMD_MOTOR_NOT_STOPPED);
+    return sw_ok(resp);
+}
 
+static int ext_backlash_status(char axis, uint32_t arg, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    if (a->type != AXIS_DC_MOTOR) return resp2(resp, BACKLASH_IDLE);
+    return resp2(resp, dc_motor_get_backlash_state(a->dc_motor));
+}
 
-static int get_status(char *cmd, char *resp)
-{
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    int status = 0;
-    switch (cmd[2]) {
-        case '1':
-            if (dc_motor_get_running(&dc_motor_context)) status |= STATUS_RUNNING;
-            if (!dc_motor_get_stop_at_target(&dc_motor_context)) status |= STATUS_TRACKING;
-            if (dc_motor_get_direction(&dc_motor_context)) status |= STATUS_CCW;
-            if (dc_motor_get_init(&dc_motor_context)) status |= STATUS_INIT;
-            
-            return resp3(resp, status);
-        case '2':
-            return resp3(resp, 0);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+static int ext_regime(char axis, uint32_t arg, char *resp)
+{
+    axis_t *a = axis_first(axis);
+    // the stepper has no PID
+    if (a->type != AXIS_DC_MOTOR) return sw_error(resp, CMD_INVALID_CHAR);
+    return resp2(resp, dc_motor_get_regime(a->dc_motor));
 }
 
-static int get_high_speed(char *cmd, char *resp)
+#define EXT_GUIDE_PLUS         0x30 // arg pulse in ms, increasing the position
+#define EXT_GUIDE_MINUS        0x31 // arg pulse in ms, decreasing the position
+#define EXT_GUIDE_STATUS       0x32 // bit 0 pulse running, bit 1 ST-4 input active
+
+static int ext_guide_plus(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    int status = 0;
-    switch (cmd[2]) {
-        case '1':
-            return resp2(resp, 1);
-        case '2':
-            return resp2(resp, 1);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
-    }
+    FOR_AXES(a, axis) guide_pulse(axis_get_guide(a), 1, arg * 1000);
+    return sw_ok(resp);
+}
+
+static int ext_guide_minus(char axis, uint32_t arg, char *resp)
+{
+    FOR_AXES(a, axis) guide_pulse(axis_get_guide(a), -1, arg * 1000);
+    return sw_ok(resp);
 }
 
-static int get_1x(char *cmd, char *resp)
+static int ext_guide_status(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, DC_WORM_PERIOD);
-        case '2':
-            return resp6(resp, DC_WORM_PERIOD);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+    guide_t *guide = axis_get_guide(axis_first(axis));
+    return resp2(resp, (guide_get_pulse_active(guide) ? 0x01 : 0) | (guide_get_direction(guide) ? 0x02 : 0));
+}
+
+#define EXT_TIMING             0x40 // arg histogram * 256 + item, see below
+#define EXT_TIMING_RESET       0x41
+
+// histograms 0 control ISR latency, 1 control ISR duration, 2 UART reply
+// latency, or an opcode character for its handling time; item a bucket
+// count, 0xFE the maximum, 0xFF the cycles per microsecond
+#define EXT_TIMING_MAX         0xFE
+#define EXT_TIMING_RATE        0xFF
+
+static int ext_timing(char axis, uint32_t arg, char *resp)
+{
+    uint32_t item = arg & 0xFF;
+    uint32_t id = arg >> 8;
+    if (item == EXT_TIMING_RATE) return resp6(resp, timing_cycles_per_us());
+
+    if (id >= TIMING_COMMAND) {
+        if ((id >= 128) || !command_timing[id]) return sw_error(resp, CMD_INVALID_CHAR);
+        id = TIMING_COMMAND + command_timing[id] - 1;
     }
+    timing_hist_t hist;
+    timing_get(id, &hist);
+
+    uint32_t v;
+    if (item == EXT_TIMING_MAX) v = hist.max;
+    else if (item < TIMING_BUCKETS) v = hist.count[item];
+    else return sw_error(resp, CMD_INVALID_CHAR);
+    return resp6(resp, (v > 0xFFFFFF) ? 0xFFFFFF : v);
 }
 
-static int get_version(char *cmd, char *resp)
+static int ext_timing_reset(char axis, uint32_t arg, char *resp)
 {
-    if ((cmd[3] != 0x0d) && (cmd[3] != 0x0a)) return sw_error(resp, CMD_LEN_ERROR);
-    switch (cmd[2]) {
-        case '1':
-            return resp6(resp, 0x123456);
-        case '2':
-            return resp6(resp, 0x123456);
-        default:
-            return sw_error(resp, CMD_INVALID_CHAR);
+    timing_reset();
+    return sw_ok(resp);
+}
+
+#define EXT_STREAM             0x60 // arg frames per second to this interface, 0 stops
+
+static int ext_stream(char axis, uint32_t arg, char *resp)
+{
+    if (arg > STREAM_MAX_RATE_HZ) return sw_error(resp, CMD_INVALID_CHAR);
+    stream_subscribe(command_source, arg);
+    return sw_ok(resp);
+}
+
+#define EXT_POWER_TIME         0x50 // arg power_state_t, seconds in it
+#define EXT_POWER_RESET        0x51
+
+static int ext_power_time(char axis, uint32_t arg, char *resp)
+{
+    if (arg >= POWER_STATES) return sw_error(resp, CMD_INVALID_CHAR);
+    int64_t s = power_get_time((power_state_t)arg) / 1000000;
+    return resp6(resp, (s > 0xFFFFFF) ? 0xFFFFFF : (uint32_t)s);
+}
+
+static int ext_power_reset(char axis, uint32_t arg, char *resp)
+{
+    power_reset_time();
+    return sw_ok(resp);
+}
+
+typedef int (*sw_handler_t)(char axis, uint32_t value, char *resp);
+
+static const sw_handler_t extended_commands[256] = {
+    [EXT_TELEMETRY] = ext_telemetry,
+    [EXT_TELEMETRY_DROPPED] = ext_telemetry_dropped,
+    [EXT_TELEMETRY_RESET] = ext_telemetry_reset,
+    [EXT_PEC_RECORD] = ext_pec_record,
+    [EXT_PEC_STATUS] = ext_pec_status,
+    [EXT_PEC_PLAYBACK] = ext_pec_playback,
+    [EXT_PEC_SAVE] = ext_pec_save,
+    [EXT_AUTOTUNE] = ext_autotune,
+    [EXT_AUTOTUNE_STATUS] = ext_autotune_status,
+    [EXT_GAIN] = ext_gain,
+    [EXT_DUTY_MAP] = ext_duty_map,
+    [EXT_DUTY_MAP_CLEAR] = ext_duty_map_clear,
+    [EXT_BACKLASH] = ext_backlash,
+    [EXT_BACKLASH_SET] = ext_backlash_set,
+    [EXT_BACKLASH_MEASURE] = ext_backlash_measure,
+    [EXT_BACKLASH_STATUS] = ext_backlash_status,
+    [EXT_REGIME] = ext_regime,
+    [EXT_GUIDE_PLUS] = ext_guide_plus,
+    [EXT_GUIDE_MINUS] = ext_guide_minus,
+    [EXT_GUIDE_STATUS] = ext_guide_status,
+    [EXT_TIMING] = ext_timing,
+    [EXT_TIMING_RESET] = ext_timing_reset,
+    [EXT_POWER_TIME] = ext_power_time,
+    [EXT_POWER_RESET] = ext_power_reset,
+    [EXT_STREAM] = ext_stream,
+};
+
+// the ones that need the control step running, see power.h
+static const bool extended_wakes[256] = {
+    [EXT_TELEMETRY] = true,
+    [EXT_PEC_RECORD] = true,
+    [EXT_PEC_PLAYBACK] = true,
+    [EXT_PEC_SAVE] = true,
+    [EXT_AUTOTUNE] = true,
+    [EXT_BACKLASH_MEASURE] = true,
+    [EXT_GUIDE_PLUS] = true,
+    [EXT_GUIDE_MINUS] = true,
+    [EXT_STREAM] = true,
+};
+
+static int extended(char axis, uint32_t value, char *resp)
+{
+    sw_handler_t handler = extended_commands[value & 0xFF];
+    if (!handler) return sw_error(resp, CMD_UNKNOWN);
+    return handler(axis, value >> 8, resp);
+}
+
+
+#define AXIS_1    0x01
+#define AXIS_2    0x02
+#define AXIS_BOTH 0x04
+#define AXIS_SET  (AXIS_1 | AXIS_2 | AXIS_BOTH)
+#define AXIS_GET  (AXIS_1 | AXIS_2)
+
+#define PAYLOAD_ANY 0xFF // not checked
+#define PAYLOAD_MAX 6
+
+typedef struct {
+    uint8_t axis_mask;
+    uint8_t payload;  // hex digits
+    sw_handler_t handler;
+} sw_command_t;
+
+static const sw_command_t commands[128] = {
+    ['E'] = { AXIS_SET, 6, set_position },
+    ['F'] = { AXIS_SET, PAYLOAD_ANY, init_done },
+    ['G'] = { AXIS_SET, 2, set_mode },
+    ['S'] = { AXIS_SET, 6, set_target },
+    ['I'] = { AXIS_SET, 6, set_period },
+    ['J'] = { AXIS_SET, 0, start },
+    ['K'] = { AXIS_SET, 0, stop },
+    ['L'] = { AXIS_SET, 0, instant_stop },
+    ['O'] = { AXIS_SET, PAYLOAD_ANY, set_aux },
+    ['P'] = { AXIS_SET, PAYLOAD_ANY, set_guiding },
+    ['V'] = { AXIS_SET, PAYLOAD_ANY, set_led },
+    ['X'] = { AXIS_SET, PAYLOAD_ANY, extended },
+    ['a'] = { AXIS_GET, 0, get_cpr },
+    ['b'] = { AXIS_GET, 0, get_freq },
+    ['h'] = { AXIS_GET, 0, get_target },
+    ['i'] = { AXIS_GET, 0, get_period },
+    ['j'] = { AXIS_GET, 0, get_pos },
+    ['f'] = { AXIS_GET, 0, get_status },
+    ['g'] = { AXIS_GET, 0, get_high_speed },
+    ['D'] = { AXIS_GET, 0, get_1x },
+    ['e'] = { AXIS_GET, 0, get_version },
+};
+
+static const sw_command_t no_command;
+
+static inline const sw_command_t *lookup(uint8_t opcode)
+{
+    return (opcode < 128) ? &commands[opcode] : &no_command;
+}
+
+// setters resume a suspended control step, inquiries read the last state
+static bool wakes(uint8_t opcode, uint32_t value)
+{
+    if (opcode == 'X') return extended_wakes[value & 0xFF];
+    return lookup(opcode)->axis_mask == AXIS_SET;
+}
+
+enum {
+    PARSE_IDLE,
+    PARSE_OPCODE,
+    PARSE_AXIS,
+    PARSE_PAYLOAD,
+};
+
+#define PARSE_OK 0xFF
+
+int sw_parser_feed(sw_parser_t *parser, char ch, char *resp)
+{
+    if (ch == ':') {
+        parser->state = PARSE_OPCODE;
+        parser->error = PARSE_OK;
+        parser->opcode = 0;
+        parser->len = 0;
+        parser->value = 0;
+        return 0;
+    }
+    if (parser->state == PARSE_IDLE) return 0;
+
+    if ((ch == 0x0d) || (ch == 0x0a)) {
+        const sw_command_t *command = lookup(parser->opcode);
+        int state = parser->state;
+        parser->state = PARSE_IDLE;
+
+        if (state != PARSE_PAYLOAD) return sw_error(resp, command->handler ? CMD_LEN_ERROR : CMD_UNKNOWN);
+        if (parser->error != PARSE_OK) return sw_error(resp, parser->error);
+        if ((command->payload != PAYLOAD_ANY) && (parser->len != command->payload)) return sw_error(resp, CMD_LEN_ERROR);
+
+        // waiting for the other interface included
+        uint32_t start = timing_cycles();
+        xSemaphoreTake(command_lock, portMAX_DELAY);
+        command_source = parser->source;
+        power_command_begin(wakes(parser->opcode, parser->value));
+        int len = command->handler(parser->axis, parser->value, resp);
+        power_command_end();
+        uint8_t timing = command_timing[parser->opcode];
+        if (timing) timing_record(TIMING_COMMAND + timing - 1, timing_cycles() - start);
+        xSemaphoreGive(command_lock);
+        return len;
     }
+
+    switch (parser->state) {
+        case PARSE_OPCODE:
+            parser->opcode = ch;
+            parser->state = PARSE_AXIS;
+            break;
+        case PARSE_AXIS:
+            parser->axis = ch;
+            parser->state = PARSE_PAYLOAD;
+            {
+                const sw_command_t *command = lookup(parser->opcode);
+                uint8_t axis_bit = ((ch >= '1') && (ch <= '3')) ? 1 << (ch - '1') : 0;
+                if (!command->handler) parser->error = CMD_UNKNOWN;
+                else if (!(command->axis_mask & axis_bit)) parser->error = CMD_INVALID_CHAR;
+            }
+            break;
+        case PARSE_PAYLOAD:
+            if (parser->len >= PAYLOAD_MAX) {
+                parser->error = CMD_LEN_ERROR;
+                break;
+            }
+            {
+                // digits come in byte pairs, least significant byte first
+                uint8_t nibble = hex_nibble[(uint8_t)ch];
+                if (nibble) parser->value |= (uint32_t)(nibble - 1) << ((parser->len & ~1) * 4 + ((parser->len & 1) ? 0 : 4));
+                else parser->error = CMD_INVALID_CHAR;
+                parser->len++;
+            }
+            break;
+    }
+    return 0;
 }
 
+void sw_command_lock(void)
+{
+    xSemaphoreTake(command_lock, portMAX_DELAY);
+}
 
+void sw_command_unlock(void)
+{
+    xSemaphoreGive(command_lock);
+}
+
+void sw_protocol_init(void)
+{
+    command_lock = xSemaphoreCreateMutex();
+
+    int n = 0;
+    for (int i = 0; (i < 128) && (n < TIMING_COMMANDS); i++) {
+        if (commands[i].handler) command_timing[i] = ++n;
+    }
+}
 
-int handle_command(char *cmd, char *resp)
-{
-    if (cmd[0] != ':') return sw_error(resp, CMD_INVALID_CHAR);
-    switch (cmd[1]) {
-        case 'E':
-            return set_position(cmd, resp);
-        case 'F':
-            return init_done(cmd, resp);
-        case 'G':
-            return set_mode(cmd, resp);
-        case 'S':
-            return set_target(cmd, resp);
-        case 'I':
-            return set_period(cmd, resp);
-        case 'J':
-            return start(cmd, resp);
-        case 'K':
-            return stop(cmd, resp);
-        case 'L':
-            return instant_stop(cmd, resp);
-        case 'O':
-            return set_aux(cmd, resp);
-        case 'P':
-            return set_guiding(cmd, resp);
-        case 'V':
-            return set_led(cmd, resp);
-        case 'a':
-            return get_cpr(cmd, resp);
-        case 'b':
-            return get_freq(cmd, resp);
-        case 'h':
-            return get_target(cmd, resp);
-        case 'i':
-            return get_period(cmd, resp);
-        case 'j':
-            return get_pos(cmd, resp);
-        case 'f':
-            return get_status(cmd, resp);
-        case 'g':
-            return get_high_speed(cmd, resp);
-        case 'D':
-            return get_1x(cmd, resp);
-        case 'e':
-            return get_version(cmd, resp);
-        default:
-            return sw_error(resp, CMD_UNKNOWN);
+int handle_command(sw_source_t source, const char *cmd, int len, char *resp)
+{
+    sw_parser_t parser = {
+        .state = PARSE_IDLE,
+        .source = source,
+    };
+    if ((len < 1) || (cmd[0] != ':')) return sw_error(resp, CMD_INVALID_CHAR);
+    for (int i = 0; i < len; i++) {
+        int reply = sw_parser_feed(&parser, cmd[i], resp);
+        if (reply) return reply;
+    }
+    return sw_error(resp, CMD_LEN_ERROR);
+}
+
+// the same encoding as the :j and :f replies, without '='
+void sw_stream_frame(char *frame)
+{
+    char resp[SW_RESP_MAX];
+    char *p = frame;
+    *p++ = '#';
+    xSemaphoreTake(command_lock, portMAX_DELAY);
+    for (int i = 0; i < AXES; i++) {
+        resp6(resp, axis_pos(&axes[i]));
+        memcpy(p, resp + 1, 6);
+        resp3(resp, axis_status(&axes[i]));
+        memcpy(p + 6, resp + 1, 3);
+        p += 9;
     }
-}
\ No newline at end of file
+    xSemaphoreGive(command_lock);
+    *p = 0x0d;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SW_RESP_MAX 16
+
+// interface a command arrived on
+typedef enum {
+    SW_SOURCE_UART,
+    SW_SOURCE_UDP,
+    SW_SOURCES,
+} sw_source_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t error;    // reported when the terminator arrives
+    uint8_t opcode;
+    char axis;
+    uint8_t len;      // payload digits received
+    uint32_t value;   // payload decoded so far
+    uint8_t source;   // sw_source_t
+} sw_parser_t;
+
+void sw_protocol_init(void);
+
+// drop a partially received command
+static inline void sw_parser_reset(sw_parser_t *parser)
+{
+    parser->state = 0;
+}
+
+// feed one received byte, returns the length of the reply written to resp
+// once a command is complete, 0 otherwise
+int sw_parser_feed(sw_parser_t *parser, char ch, char *resp);
+
+// held while a command is handled; tasks that change state the handlers
+// own, like the gains an autotune found, take it too
+void sw_command_lock(void);
+void sw_command_unlock(void);
+
+// handle one complete command starting with ':', returns the reply length
+int handle_command(sw_source_t source, const char *cmd, int len, char *resp);
+
+// position and status of both axes as a stream frame, see stream.h; takes the
+// command lock, not from the control task
+void sw_stream_frame(char *frame);
@@ -0,0 +1,118 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+
+#include "telemetry.h"
+#include "eqmod_uart.h"
+#include "scheduler.h"
+
+#define DRAIN_INTERVAL_MS 20
+#define DRAIN_PERIODS ((DRAIN_INTERVAL_MS * CONTROL_RATE_HZ + 999) / 1000)
+
+// single producer (the control ISR), single consumer (the drain task)
+static DRAM_ATTR telemetry_record_t ring[TELEMETRY_RING_SIZE];
+static uint32_t ring_head;
+static uint32_t ring_tail;
+static uint32_t dropped;
+static bool enabled;
+static TaskHandle_t drain_task;
+static int drain_periods;
+
+static uint8_t frame[8 + TELEMETRY_FRAME_RECORDS * sizeof(telemetry_record_t) + 2];
+
+void IRAM_ATTR telemetry_push(const telemetry_record_t *record)
+{
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return;
+
+    uint32_t head = ring_head;
+    if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= TELEMETRY_RING_SIZE) {
+        __atomic_store_n(&dropped, dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring[head % TELEMETRY_RING_SIZE] = *record;
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int build_frame(uint8_t seq)
+{
+    uint32_t tail = ring_tail;
+    uint32_t count = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) - tail;
+    if (count == 0) return 0;
+    if (count > TELEMETRY_FRAME_RECORDS) count = TELEMETRY_FRAME_RECORDS;
+
+    uint32_t drops = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    frame[0] = TELEMETRY_SYNC0;
+    frame[1] = TELEMETRY_SYNC1;
+    frame[2] = count;
+    frame[3] = seq;
+    memcpy(frame + 4, &drops, sizeof(drops));
+
+    uint8_t *p = frame + 8;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(p, &ring[(tail + i) % TELEMETRY_RING_SIZE], sizeof(telemetry_record_t));
+        p += sizeof(telemetry_record_t);
+    }
+    __atomic_store_n(&ring_tail, tail + count, __ATOMIC_RELEASE);
+
+    uint16_t sum = 0;
+    for (uint8_t *b = frame; b < p; b++) sum += *b;
+    memcpy(p, &sum, sizeof(sum));
+    return p + sizeof(sum) - frame;
+}
+
+// control task, wakes the drain task only when there is something to do
+static void telemetry_on_control_task(void *user_ctx)
+{
+    if (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) return;
+    if (++drain_periods < DRAIN_PERIODS) return;
+    drain_periods = 0;
+    xTaskNotifyGive(drain_task);
+}
+
+static void telemetry_task(void *pvParameters)
+{
+    uint8_t seq = 0;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+            // discard what was pushed before streaming was turned off
+            __atomic_store_n(&ring_tail, __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            continue;
+        }
+
+        int len;
+        while ((len = build_frame(seq)) > 0) {
+            eqmod_uart_write((const char *)frame, len);
+            seq++;
+        }
+    }
+}
+
+void telemetry_init(void)
+{
+    // below the command handlers, streaming must not delay replies
+    xTaskCreatePinnedToCore(telemetry_task, "telemetry", 2048, NULL, 1, &drain_task, COMMS_CORE);
+    scheduler_add_task(telemetry_on_control_task, NULL);
+}
+
+void telemetry_enable(bool enable)
+{
+    __atomic_store_n(&enabled, enable, __ATOMIC_RELEASE);
+}
+
+bool telemetry_get_enabled(void)
+{
+    return enabled;
+}
+
+uint32_t telemetry_get_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void telemetry_reset_dropped(void)
+{
+    __atomic_store_n(&dropped, 0, __ATOMIC_RELAXED);
+}
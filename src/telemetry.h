@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// one control period
+typedef struct {
+    uint32_t time;        // us, wraps
+    int16_t delta;        // encoder counts in the period, positive in the run direction
+    uint16_t comp_value;
+    int32_t error;        // speed error, counts Q16
+    int32_t integral;     // position error, counts Q16
+} telemetry_record_t;
+
+// power of 2, 2.5 s of records at the default 200 Hz control rate
+#define TELEMETRY_RING_SIZE 512
+#define TELEMETRY_FRAME_RECORDS 32
+
+// frame on the wire, little endian:
+//   0xA5 0x5A, uint8 record count, uint8 frame sequence,
+//   uint32 records dropped so far, records, uint16 sum of all preceding bytes
+#define TELEMETRY_SYNC0 0xA5
+#define TELEMETRY_SYNC1 0x5A
+
+void telemetry_init(void);
+
+// frames go to the EQMOD UART, use UDP for commands while streaming
+void telemetry_enable(bool enable);
+bool telemetry_get_enabled(void);
+
+// control ISR, never blocks, counts the record as dropped when the ring is full
+void telemetry_push(const telemetry_record_t *record);
+
+uint32_t telemetry_get_dropped(void);
+void telemetry_reset_dropped(void);
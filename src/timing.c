@@ -0,0 +1,37 @@
+#include <string.h>
+#include "esp_attr.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_rom_sys.h"
+#endif
+
+#include "timing.h"
+
+static DRAM_ATTR timing_hist_t hists[TIMING_HISTS];
+
+uint32_t timing_cycles_per_us(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return 1000;
+#else
+    return esp_rom_get_cpu_ticks_per_us();
+#endif
+}
+
+void IRAM_ATTR timing_record(timing_id_t id, uint32_t cycles)
+{
+    timing_hist_t *hist = &hists[id];
+    int bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+    if (bucket >= TIMING_BUCKETS) bucket = TIMING_BUCKETS - 1;
+    hist->count[bucket]++;
+    if (cycles > hist->max) hist->max = cycles;
+}
+
+void timing_get(timing_id_t id, timing_hist_t *hist)
+{
+    memcpy(hist, &hists[id], sizeof(*hist));
+}
+
+void timing_reset(void)
+{
+    memset(hists, 0, sizeof(hists));
+}
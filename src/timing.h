@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <time.h>
+#else
+#include "esp_cpu.h"
+#endif
+
+// log2 histograms of CPU cycles, bucket n counts [2^n, 2^(n+1)), the last one
+// everything longer; 2^24 cycles is 70 ms at 240 MHz
+#define TIMING_BUCKETS 24
+
+typedef struct {
+    uint32_t count[TIMING_BUCKETS];
+    uint32_t max;
+} timing_hist_t;
+
+typedef enum {
+    TIMING_ISR_LATENCY,      // control timer alarm to the start of the ISR
+    TIMING_ISR_DURATION,     // control step of all axes
+    TIMING_UART_REPLY,       // UART data event to the reply written
+    TIMING_COMMAND,          // first of TIMING_COMMANDS, per opcode, see sw_protocol.c
+} timing_id_t;
+
+#define TIMING_COMMANDS 24
+#define TIMING_HISTS (TIMING_COMMAND + TIMING_COMMANDS)
+
+// wraps, only differences of up to 2^32 cycles are meaningful
+static inline uint32_t IRAM_ATTR timing_cycles(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    // host build, nanoseconds stand in for 1 GHz cycles
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#else
+    return esp_cpu_get_cycle_count();
+#endif
+}
+
+uint32_t timing_cycles_per_us(void);
+
+// any context, writers of one histogram must not run concurrently
+void timing_record(timing_id_t id, uint32_t cycles);
+
+void timing_get(timing_id_t id, timing_hist_t *hist);
+void timing_reset(void);
@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_event.h"
+#endif
+
+#include "udp_server.h"
+#include "sw_protocol.h"
+#include "scheduler.h"
+
+// SynScan WiFi convention: one command per datagram, one reply datagram
+#define UDP_PORT 11880
+#define UDP_MAX_DATAGRAM 64
+
+#ifndef WIFI_SSID
+#define WIFI_SSID ""
+#endif
+#ifndef WIFI_PASSWORD
+#define WIFI_PASSWORD ""
+#endif
+#define WIFI_AP_SSID "SA_ESP32"
+
+static int sock = -1;
+static struct sockaddr_in command_peer;   // sender of the command being handled
+static struct sockaddr_in stream_peer;
+static bool stream_peer_valid;
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if ((event_id == WIFI_EVENT_STA_START) || (event_id == WIFI_EVENT_STA_DISCONNECTED)) {
+        esp_wifi_connect();
+    }
+}
+
+// join WIFI_SSID if it is configured, otherwise open an access point like the SynScan adapter
+static void wifi_init(void)
+{
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&init_config));
+
+    wifi_config_t wifi_config = { 0 };
+    if (strlen(WIFI_SSID) > 0) {
+        esp_netif_create_default_wifi_sta();
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL, NULL));
+        strncpy((char *)wifi_config.sta.ssid, WIFI_SSID, sizeof(wifi_config.sta.ssid));
+        strncpy((char *)wifi_config.sta.password, WIFI_PASSWORD, sizeof(wifi_config.sta.password));
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    }
+    else {
+        esp_netif_create_default_wifi_ap();
+        strncpy((char *)wifi_config.ap.ssid, WIFI_AP_SSID, sizeof(wifi_config.ap.ssid));
+        wifi_config.ap.ssid_len = strlen(WIFI_AP_SSID);
+        wifi_config.ap.channel = 1;
+        wifi_config.ap.authmode = WIFI_AUTH_OPEN;
+        wifi_config.ap.max_connection = 4;
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
+        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
+    }
+    ESP_ERROR_CHECK(esp_wifi_start());
+}
+
+#endif
+
+static void udp_server_task(void *pvParameters)
+{
+    static char rx[UDP_MAX_DATAGRAM];
+    static char resp[SW_RESP_MAX];
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_PORT),
+    };
+#if CONFIG_IDF_TARGET_LINUX
+    // host build, no radio
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#else
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+#endif
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        sock = -1;
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        socklen_t from_len = sizeof(command_peer);
+        int len = recvfrom(sock, rx, sizeof(rx), 0, (struct sockaddr *)&command_peer, &from_len);
+        if (len <= 0) continue;
+
+        // the datagram is parsed in place
+        int resp_len = handle_command(SW_SOURCE_UDP, rx, len, resp);
+        sendto(sock, resp, resp_len, 0, (struct sockaddr *)&command_peer, from_len);
+    }
+}
+
+void udp_server_init(void)
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    wifi_init();
+#endif
+    xTaskCreatePinnedToCore(udp_server_task, "udp_server", 4096, NULL, COMMS_TASK_PRIORITY, NULL, COMMS_CORE);
+}
+
+// from the subscribe command, on the UDP server task
+void udp_server_stream_subscribe(bool subscribe)
+{
+    __atomic_store_n(&stream_peer_valid, false, __ATOMIC_RELEASE);
+    if (!subscribe) return;
+    stream_peer = command_peer;
+    __atomic_store_n(&stream_peer_valid, true, __ATOMIC_RELEASE);
+}
+
+void udp_server_stream_write(const char *buf, int len)
+{
+    if (!__atomic_load_n(&stream_peer_valid, __ATOMIC_ACQUIRE)) return;
+    sendto(sock, buf, len, 0, (struct sockaddr *)&stream_peer, sizeof(stream_peer));
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+// EQMOD over UDP port 11880, shares the command handlers with the UART
+void udp_server_init(void);
+
+// stream frames go to the sender of the subscribing command
+void udp_server_stream_subscribe(bool subscribe);
+void udp_server_stream_write(const char *buf, int len);